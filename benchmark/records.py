@@ -0,0 +1,46 @@
+#!/usr/bin/env python
+#
+# Encode and decode cost of small records, one call per record: the path
+# that per call overheads (writer and reader setup, buffer growth) show
+# up in the most.
+#
+# ./records.py
+#
+from __future__ import print_function
+from __future__ import division
+
+import random
+import time
+
+import escode
+
+NUMRECORDS = 10000
+TRIALS = 5
+
+SHAPES = [
+    ('scalar', lambda i: i),
+    ('tiny', lambda i: {u'id': i, u'ok': True}),
+    ('small', lambda i: {u'id': i, u'user': u'user%d' % i, u'ts': 1600000000 + i,
+                         u'score': i / 7.0, u'tags': [u'a', u'b'], u'ref': None}),
+    ('medium', lambda i: {u'id': i, u'payload': u'x' * random.randint(100, 400),
+                          u'vals': list(range(20)), u'meta': {u'src': u'web'}}),
+]
+
+
+def best_ns(fn, items):
+    best = float('inf')
+    for _ in range(TRIALS):
+        s = time.process_time_ns()
+        for item in items:
+            fn(item)
+        best = min(best, time.process_time_ns() - s)
+    return best / len(items)
+
+
+print('%-8s %8s %12s %12s' % ('shape', 'bytes', 'encode (ns)', 'decode (ns)'))
+for name, make in SHAPES:
+    records = [make(i) for i in range(NUMRECORDS)]
+    blobs = [escode.encode(rec) for rec in records]
+    size = sum(len(blob) for blob in blobs) / len(blobs)
+    print('%-8s %8.0f %12.1f %12.1f' % (
+        name, size, best_ns(escode.encode, records), best_ns(escode.decode, blobs)))
@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+#
+# Encode cost of str values, by representation kind.
+#
+# For each kind, times encoding a list of short strings and measures the
+# memory allocated transiently while encoding a single str into a
+# preallocated buffer (so there is no result object to account for): any
+# temporary UTF-8 copy of the str shows up in the tracemalloc peak, and is
+# reported as a count of UTF-8 bytes objects per str.
+#
+# ./strings.py
+#
+from __future__ import print_function
+from __future__ import division
+
+import random
+import sys
+import time
+import tracemalloc
+
+import escode
+
+NUMSTRS = 10000
+TRIALS = 5
+
+KINDS = [
+    ('ascii', u'abcdefghijklmnopqrstuvwxyz0123456789'),
+    ('latin1', u'abcdef\xe0\xe9\xee\xf5\xfc\xff'),
+    ('ucs2', u'abcĀαЖ中€'),
+    ('ucs4', u'abc€\U0001F600\U0001F680'),
+]
+
+
+def randstr(alphabet, minlen=4, maxlen=24):
+    return u''.join(random.choice(alphabet)
+                    for _ in range(random.randint(minlen, maxlen)))
+
+
+def encode_time(strs):
+    best = float('inf')
+    for _ in range(TRIALS):
+        s = time.process_time_ns()
+        for text in strs:
+            escode.encode(text)
+        best = min(best, time.process_time_ns() - s)
+    return best / len(strs)
+
+
+def temporaries(strs):
+    total = 0
+    page = bytearray(4096)
+    tracemalloc.start()
+    for text in strs:
+        size = sys.getsizeof(text.encode('utf8'))
+        tracemalloc.reset_peak()
+        base = tracemalloc.get_traced_memory()[0]
+        escode.encode_into(text, page)
+        peak = tracemalloc.get_traced_memory()[1]
+        total += (peak - base) / size
+    tracemalloc.stop()
+    return total / len(strs)
+
+
+print('%-8s %12s %18s' % ('kind', 'encode (ns)', 'temporaries/str'))
+for name, alphabet in KINDS:
+    strs = [randstr(alphabet) for _ in range(NUMSTRS)]
+    print('%-8s %12.1f %18.2f' % (name, encode_time(strs), temporaries(strs)))
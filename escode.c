@@ -12,8 +12,15 @@
 #include "include/core/mypython.h"
 #include "include/core/strbuf.h"
 #include "include/escode.h"
+#include "include/registry.h"
 #include "include/encoder.h"
 #include "include/decoder.h"
+#include "include/tape.h"
+#include "include/encoderobject.h"
+#include "include/decoderobject.h"
+#include "include/lazy.h"
+#include "include/path.h"
+#include "include/records.h"
 
 /* Encode object or list into its ESCODE index representation */
 
@@ -28,10 +35,11 @@ ESCODE_encode_index(PyObject *self, PyObject *args)
 
   ESWriter buf; //Allocate on the stack
   ESWriter*pbuf = &buf;
-  ESWriter_init(pbuf, 256);
-  buf.ops=OP_STRBUFINDEX;
+  ESWriter_initbytes(pbuf, 256);
+  buf.ops|=OP_STRBUFINDEX;
 
-  if (!encode_object(object, pbuf)) {
+  ESEncodeOpts opts = {0};
+  if (!encode_object(object, pbuf, &opts)) {
     ESWriter_free(pbuf);
     if (!PyErr_Occurred()) {
       PyErr_SetString(ESCODE_EncodeError, "Error while encoding index");
@@ -51,17 +59,111 @@ ESCODE_encode_index(PyObject *self, PyObject *args)
   return ESWriter_finish(pbuf, PyBytes_FromStringAndSize);
 }
 
+/* Measure the exact length of the ESCODE representation of object */
+
+static int
+ESCODE_size(PyObject *object, uint64_t *size)
+{
+  ESWriter buf; //Allocate on the stack
+  ESWriter*pbuf = &buf;
+  ESWriter_initsize(pbuf);
+
+  ESEncodeOpts opts = {0};
+  if (!encode_object(object, pbuf, &opts)) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(ESCODE_EncodeError, "Object too large to encode");
+    }
+    return 0;
+  }
+
+  *size = pbuf->offset;
+  return 1;
+}
+
+static PyObject*
+ESCODE_encoded_size(PyObject *self, PyObject *object)
+{
+  uint64_t size;
+  if (!ESCODE_size(object, &size)) {
+    return NULL;
+  }
+  return PyLong_FromUnsignedLongLong(size);
+}
+
+/* Encode object into a writable buffer, returning the bytes written */
+
+static PyObject*
+ESCODE_encode_into(PyObject *self, PyObject *args)
+{
+  PyObject *object;
+  Py_buffer view;
+  Py_ssize_t offset = 0;
+  if (!PyArg_ParseTuple(args, "Ow*|n", &object, &view, &offset)) {
+    return NULL;
+  }
+
+  if (offset < 0 || offset > view.len) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "offset out of range for buffer");
+    return NULL;
+  }
+
+  ESWriter buf; //Allocate on the stack
+  ESWriter*pbuf = &buf;
+  ESWriter_initfixed(pbuf, (byte*)view.buf + offset, (uint64_t)(view.len - offset));
+
+  ESEncodeOpts opts = {0};
+  int ok = encode_object(object, pbuf, &opts);
+  PyBuffer_Release(&view);
+
+  if (ok) {
+    return PyLong_FromUnsignedLongLong(pbuf->offset);
+  }
+
+  if (!PyErr_Occurred()) {
+    // Out of room: report how much the whole encoding needs
+    uint64_t size;
+    if (!ESCODE_size(object, &size)) {
+      return NULL;
+    }
+
+    PyObject *exc = PyObject_CallFunction(
+        ESCODE_EncodeError, "s", "buffer too small to encode into");
+    if (exc == NULL) return NULL;
+    PyObject *needed = PyLong_FromUnsignedLongLong(size);
+    if (needed == NULL || PyObject_SetAttrString(exc, "needed", needed) < 0) {
+      Py_XDECREF(needed);
+      Py_DECREF(exc);
+      return NULL;
+    }
+    Py_DECREF(needed);
+    PyErr_SetObject(ESCODE_EncodeError, exc);
+    Py_DECREF(exc);
+  }
+  return NULL;
+}
+
 /* Encode object into its ESCODE representation */
 
+/* Output size hint for module level encode, adapted per thread */
+static __thread uint64_t ESCODE_threadsizehint = ESCODE_SIZEHINT;
+
+/**
+ * Encode into a bytes object presized from *sizehint, which then learns
+ * the output length. Runs of similarly sized objects thereby get one
+ * allocation (shrunk in place at the end) instead of repeated growth.
+ * opts may be NULL for the defaults.
+ */
 static PyObject*
-ESCODE_encode(PyObject *self, PyObject *object)
+ESCODE_encode_bytes(PyObject *object, uint64_t *sizehint, ESEncodeOpts *opts)
 {
+  ESEncodeOpts defaults = {0};
 
   ESWriter buf; //Allocate on the stack
   ESWriter*pbuf = &buf;
-  ESWriter_init(pbuf, 256);
+  ESWriter_initbytes(pbuf, *sizehint);
 
-  if (!encode_object(object, pbuf)) {
+  if (!encode_object(object, pbuf, opts ? opts : &defaults)) {
     ESWriter_free(pbuf);
     if (!PyErr_Occurred()) {
       PyErr_SetString(ESCODE_EncodeError, "Error while encoding");
@@ -69,47 +171,350 @@ ESCODE_encode(PyObject *self, PyObject *object)
     return NULL;
   }
 
+  ESWriter_learnsize(*sizehint, pbuf->offset);
   return ESWriter_finish(pbuf, PyBytes_FromStringAndSize);
 }
 
+static PyObject*
+ESCODE_encode(PyObject *self, PyObject *object)
+{
+  return ESCODE_encode_bytes(object, &ESCODE_threadsizehint, NULL);
+}
+
 
 /* Decode ESCODE representation into python objects */
 
+static inline int
+ESCODE_getbuffer(PyObject *object, Py_buffer *view)
+{
+  if (PyBytes_CheckExact(object)) {
+    view->buf = PyBytes_AS_STRING(object);
+    view->len = PyBytes_GET_SIZE(object);
+    view->obj = NULL;
+    return 0;
+  }
+  if (!PyObject_CheckBuffer(object)) {
+    PyErr_SetString(ESCODE_DecodeError, "Can not decode non-buffer");
+    return -1;
+  }
+  return PyObject_GetBuffer(object, view, PyBUF_SIMPLE);
+}
+
+/**
+ * Decode the contents of bytes or any other contiguous buffer in place,
+ * holding the view (which also keeps e.g. a bytearray from resizing)
+ * until done. Without opts->keys, dict keys are shared through a per call
+ * cache if callkeys and the blob is big enough to hold many records;
+ * smaller blobs are not worth setting it up for.
+ */
+static PyObject*
+ESCODE_decode_buffer(PyObject *object, ESDecodeOpts *opts, bool callkeys)
+{
+  Py_buffer view;
+  if (ESCODE_getbuffer(object, &view) < 0) {
+    return NULL;
+  }
+
+  PyObject *result = NULL;
+  ESDecodeOpts callopts = *opts;
+  callopts.source = object;
+  callopts.view = NULL;
+
+  ESKeyCache callcache; //Allocate on the stack
+  ESKeyCache_INIT(&callcache);
+  if (!callopts.keys && callkeys && view.len >= ESKEYCACHE_MINBLOB) {
+    callopts.keys = &callcache;
+  }
+
+  if (!view.len) {
+    result = Py_None;
+    Py_INCREF(result);
+  } else {
+    ESReader buf = {
+      .str=(byte*)view.buf,
+      .size=(uint64_t)view.len,
+    };
+    result = (callopts.twostage ?
+              estape_decode_nogil(&buf, &callopts) :
+              decode_object(&buf, &callopts));
+  }
+
+  ESKeyCache_CLEAR(&callcache);
+  Py_XDECREF(callopts.view);
+  ESCODE_releasebuffer(&view);
+  return result;
+}
+
 static PyObject*
 ESCODE_decode(PyObject *self, PyObject *object)
 {
-  if (!PyBytes_CheckExact(object)) {
-    PyErr_SetString(ESCODE_DecodeError, "Can not decode non-bytes");
+  ESDecodeOpts opts = {0};
+  return ESCODE_decode_buffer(object, &opts, 1);
+}
+
+static PyObject*
+ESCODE_loads_lazy(PyObject *self, PyObject *object)
+{
+  ESLazySource *source = eslazy_source(object);
+  if (!source) return NULL;
+
+  PyObject *result = Py_None;
+  if (!source->view.len) {
+    Py_INCREF(result);
+  } else {
+    result = eslazy_decodeat(source, 0);
+  }
+  Py_DECREF(source);
+  return result;
+}
+
+
+static PyObject*
+ESCODE_validate(PyObject *self, PyObject *object)
+{
+  Py_buffer view;
+  if (ESCODE_getbuffer(object, &view) < 0) {
     return NULL;
   }
 
-  Py_ssize_t _len = PyBytes_GET_SIZE(object);
-  if (!_len) Py_RETURN_NONE;
+  ESReader buf = {.str=(byte*)view.buf, .size=(uint64_t)view.len};
+  uint32_t maxdepth = ESCODE_maxdepth;
+  int status = ESSCAN_OK;
+  if (buf.size >= ESTAPE_NOGILMIN) {
+    Py_BEGIN_ALLOW_THREADS
+    status = estape_scan(&buf, NULL, maxdepth);
+    Py_END_ALLOW_THREADS
+  } else if (buf.size) {
+    status = estape_scan(&buf, NULL, maxdepth);
+  }
+
+  PyObject *result = (status == ESSCAN_OK ?
+                      PyLong_FromUnsignedLongLong(buf.offset) :
+                      decode_scanerror(&buf, buf.offset, status));
+  ESCODE_releasebuffer(&view);
+  return result;
+}
 
-  if (_len > UINT32_MAX) {
-    PyErr_SetString(ESCODE_DecodeError, "string too long to decode");
+static PyObject*
+ESCODE_iter_decode(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = {"source", "offsets", NULL};
+  PyObject *source;
+  int offsets = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p:iter_decode", kwlist,
+                                   &source, &offsets)) {
     return NULL;
   }
+  return esrecords_new(source, offsets);
+}
 
-  ESReader buf = {
-    .str=(byte*)PyBytes_AS_STRING(object),
-    .size=(uint32_t)_len,
-  };
-  return decode_object(&buf);
+
+/* Extract values at paths, skipping over the rest of the encoding */
+
+static PyObject*
+ESCODE_get(PyObject *self, PyObject *args)
+{
+  PyObject *object, *spec, *dflt = Py_None;
+  if (!PyArg_ParseTuple(args, "OO|O:get", &object, &spec, &dflt)) {
+    return NULL;
+  }
+
+  ESPathObject *path = espath_compile(spec);
+  if (!path) return NULL;
+
+  Py_buffer view;
+  if (ESCODE_getbuffer(object, &view) < 0) {
+    Py_DECREF(path);
+    return NULL;
+  }
+
+  ESReader buf = {.str=(byte*)view.buf, .size=(uint64_t)view.len};
+  PyObject *result = espath_get(buf, path, dflt);
+
+  ESCODE_releasebuffer(&view);
+  Py_DECREF(path);
+  return result;
+}
+
+static PyObject*
+ESCODE_project(PyObject *self, PyObject *args)
+{
+  PyObject *object, *fields;
+  if (!PyArg_ParseTuple(args, "OO:project", &object, &fields)) {
+    return NULL;
+  }
+
+  PyObject *seq = PySequence_Fast(fields, "fields must be iterable");
+  if (!seq) return NULL;
+
+  Py_buffer view;
+  if (ESCODE_getbuffer(object, &view) < 0) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  ESReader buf = {.str=(byte*)view.buf, .size=(uint64_t)view.len};
+  PyObject *result = PyDict_New();
+  for (Py_ssize_t idx = 0; result && idx < PySequence_Fast_GET_SIZE(seq); ++idx) {
+    PyObject *field = PySequence_Fast_GET_ITEM(seq, idx);
+    ESPathObject *path = espath_compile(field);
+    // A missing field is left out, marked by the path itself as default
+    PyObject *value = path ? espath_get(buf, path, (PyObject*)path) : NULL;
+    if (!value || (value != (PyObject*)path && PyDict_SetItem(result, field, value) < 0)) {
+      Py_CLEAR(result);
+    }
+    Py_XDECREF(value);
+    Py_XDECREF(path);
+  }
+
+  ESCODE_releasebuffer(&view);
+  Py_DECREF(seq);
+  return result;
+}
+
+
+/* Nesting limit for encode/decode, independent of the recursion limit */
+
+static PyObject*
+ESCODE_set_max_depth(PyObject *self, PyObject *args)
+{
+  unsigned int depth;
+  if (!PyArg_ParseTuple(args, "I", &depth)) {
+    return NULL;
+  }
+  if (!depth) {
+    PyErr_SetString(PyExc_ValueError, "max depth must be positive");
+    return NULL;
+  }
+  ESCODE_maxdepth = depth;
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+ESCODE_get_max_depth(PyObject *self, PyObject *noargs)
+{
+  return PyLong_FromUnsignedLong(ESCODE_maxdepth);
 }
 
 
+/* Extension types */
+
+static PyObject*
+ESCODE_register(PyObject *self, PyObject *args)
+{
+  PyTypeObject *type;
+  int code;
+  PyObject *encode, *decode;
+  if (!PyArg_ParseTuple(args, "O!iOO", &PyType_Type, &type, &code, &encode, &decode)) {
+    return NULL;
+  }
+  if (!PyCallable_Check(encode) || !PyCallable_Check(decode)) {
+    PyErr_SetString(PyExc_TypeError, "encode and decode must be callable");
+    return NULL;
+  }
+  if (esext_register(type, code, encode, decode, NULL, NULL) < 0) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+ESCODE_unregister(PyObject *self, PyObject *type)
+{
+  if (!PyType_Check(type)) {
+    PyErr_SetString(PyExc_TypeError, "unregister() takes a type");
+    return NULL;
+  }
+  if (esext_unregister((PyTypeObject*)type) < 0) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* C API for extension modules, exported as the escode._C_API capsule */
+
+static int
+ESCODE_RegisterType(PyTypeObject *type, int code, ESExtHook encode, ESExtHook decode)
+{
+  if (!encode || !decode) {
+    PyErr_SetString(PyExc_TypeError, "encode and decode hooks are required");
+    return -1;
+  }
+  return esext_register(type, code, NULL, NULL, encode, decode);
+}
+
+static ESCODE_CAPI ESCODE_capi = {
+  .RegisterType = ESCODE_RegisterType,
+  .UnregisterType = esext_unregister,
+};
+
+
 /* List of functions defined in the module */
 static PyMethodDef escode_methods[] = {
     {"encode", (PyCFunction)ESCODE_encode,  METH_O,
      PyDoc_STR("encode(object) -> generate the ESCODE representation for object.")},
 
+    {"encoded_size", (PyCFunction)ESCODE_encoded_size,  METH_O,
+     PyDoc_STR("encoded_size(object) -> length of the ESCODE representation for object, without encoding it.")},
+
+    {"encode_into", (PyCFunction)ESCODE_encode_into,  METH_VARARGS,
+     PyDoc_STR("encode_into(object, buffer, offset=0) -> write the ESCODE representation for object\n"
+               "into a writable buffer at offset and return the number of bytes written.\n"
+               "Raises EncodeError with the required size in its 'needed' attribute if\n"
+               "the buffer is too small; the buffer past offset is then unspecified.")},
+
     {"decode", (PyCFunction)ESCODE_decode,  METH_O,
-     PyDoc_STR("decode(string) -> parse the ESCODE representation into python objects\n")},
+     PyDoc_STR("decode(buffer) -> parse the ESCODE representation into python objects.\n"
+               "buffer is bytes or any contiguous buffer (bytearray, memoryview, mmap, ...),\n"
+               "read in place without a copy.")},
+
+    {"loads_lazy", (PyCFunction)ESCODE_loads_lazy,  METH_O,
+     PyDoc_STR("loads_lazy(buffer) -> like decode, but a dict or list is returned as a\n"
+               "read-only LazyDict or LazyList that decodes items only when accessed.\n"
+               "The proxies keep the buffer alive; materialize() decodes one whole.")},
+
+    {"iter_decode", (PyCFunction)(void(*)(void))ESCODE_iter_decode,  METH_VARARGS | METH_KEYWORDS,
+     PyDoc_STR("iter_decode(source, offsets=False) -> iterator over the back-to-back\n"
+               "records in source, a buffer (bytes, bytearray, mmap, ...) or a binary file.\n"
+               "Yields each decoded record, or (offset, record) pairs if offsets.\n"
+               "Buffers are read in place and held until the iterator is done with;\n"
+               "files are read in chunks. Dict keys are shared across records.")},
+
+    {"validate", (PyCFunction)ESCODE_validate,  METH_O,
+     PyDoc_STR("validate(buffer) -> check that buffer starts with a well formed encoding\n"
+               "(complete, known types, valid utf-8 strings, nested within the max depth)\n"
+               "and return its length in bytes, without building any objects. Raises\n"
+               "DecodeError (or RecursionError) like decode. Big buffers are checked\n"
+               "with the GIL released, so threads can validate in parallel.")},
+
+    {"get", (PyCFunction)ESCODE_get,  METH_VARARGS,
+     PyDoc_STR("get(buffer, path, default=None) -> decode only the value at path in the\n"
+               "encoding, skipping over everything else, or default if it is missing.\n"
+               "path is an escode.Path or anything escode.Path accepts, e.g. \"a.b[3]\".")},
+
+    {"project", (PyCFunction)ESCODE_project,  METH_VARARGS,
+     PyDoc_STR("project(buffer, fields) -> dict of each path in fields to its decoded\n"
+               "value, as escode.get; missing paths are left out.")},
 
     {"encode_index", (PyCFunction)ESCODE_encode_index,  METH_VARARGS,
      PyDoc_STR("encode(object) -> generate the ESCODE index representation for object.")},
 
+    {"set_max_depth", (PyCFunction)ESCODE_set_max_depth,  METH_VARARGS,
+     PyDoc_STR("set_max_depth(depth) -> set the maximum container nesting depth\n"
+               "for encoding and decoding.\n"
+               "Deeper objects raise RecursionError. This is independent of sys.getrecursionlimit().")},
+
+    {"get_max_depth", (PyCFunction)ESCODE_get_max_depth,  METH_NOARGS,
+     PyDoc_STR("get_max_depth() -> the maximum container nesting depth, see set_max_depth.")},
+
+    {"register", (PyCFunction)ESCODE_register,  METH_VARARGS,
+     PyDoc_STR("register(type, code, encode, decode) -> encode objects of exactly type\n"
+               "as extension code (0-255): encode(obj) returns the value written in\n"
+               "its place and decode(value) rebuilds the object.")},
+
+    {"unregister", (PyCFunction)ESCODE_unregister,  METH_O,
+     PyDoc_STR("unregister(type) -> remove a type added with register.")},
+
     {NULL, NULL}  // sentinel
 };
 
@@ -130,6 +535,7 @@ MODULE_INIT_FUNC(escode)
   if (m == NULL) return NULL;
 
   INIT_MYPYTHON();
+  estypemap_build();
 
   ESCODE_Error = PyErr_NewException("escode.Error", NULL, NULL);
   if (ESCODE_Error == NULL) return NULL;
@@ -151,6 +557,30 @@ MODULE_INIT_FUNC(escode)
   Py_INCREF(ESCODE_UnsupportedError);
   PyModule_AddObject(m, "UnsupportedTypeError", ESCODE_UnsupportedError);
 
+  if (PyType_Ready(&ESEncoder_Type) < 0) return NULL;
+  Py_INCREF(&ESEncoder_Type);
+  PyModule_AddObject(m, "Encoder", (PyObject*)&ESEncoder_Type);
+
+  if (PyType_Ready(&ESDecoder_Type) < 0) return NULL;
+  Py_INCREF(&ESDecoder_Type);
+  PyModule_AddObject(m, "Decoder", (PyObject*)&ESDecoder_Type);
+
+  if (eslazy_init(m) < 0) return NULL;
+
+  if (PyType_Ready(&ESRecords_Type) < 0) return NULL;
+
+  if (PyType_Ready(&ESStream_Type) < 0) return NULL;
+  Py_INCREF(&ESStream_Type);
+  PyModule_AddObject(m, "StreamDecoder", (PyObject*)&ESStream_Type);
+
+  if (PyType_Ready(&ESPath_Type) < 0) return NULL;
+  Py_INCREF(&ESPath_Type);
+  PyModule_AddObject(m, "Path", (PyObject*)&ESPath_Type);
+
+  PyObject *capi = PyCapsule_New(&ESCODE_capi, ESCODE_CAPI_NAME, NULL);
+  if (capi == NULL) return NULL;
+  PyModule_AddObject(m, "_C_API", capi);
+
   PyModule_AddStringConstant(m, "__version__", MODULE_VERSION);
 
   return m;
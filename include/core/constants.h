@@ -5,9 +5,14 @@
 #include "intlib.h"
 
 #define ESINDEX_MAX UINT16_MAX
+#define ESCODE_MAXDEPTH 1000 // default nesting limit for encode/decode
+#define ESCODE_SIZEHINT 256 // initial output buffer size for encode
 #define ESINDEX_SEP ((const byte*)"\x00\x00")
 #define ESINDEX_SEPLEN (2*sizeof(byte))
 
+// For the per value steps of the decode loops, which have several callers
+#define ESCODE_HOT static inline __attribute__((always_inline))
+
 /*********************************************************
  * TYPES
  *********************************************************/
@@ -23,5 +28,22 @@
 #if PY_VERSION_HEX >= 0x03030000
 #define ESTYPE_DEC 7
 #endif
+#define ESTYPE_BIGINT 8  //POS/NEG: ints beyond int64/uint64
+#define ESTYPE_EXT 9     //registered extension type: code, then its value
+#define ESTYPE_TABLE 10  //LIST/DICT: lookup table for the container after it
+#define ESTYPE_ARRAY 11  //packed numbers or bools: count, element code, data
+#define ESTYPE_TINYINT 12 //compact: an int of 0..ESTINY_MAX in the info bits
+#define ESTYPE_TINYSTR 13 //compact: a str of 0..ESTINY_MAX UTF-8 bytes, the length in the info bits
+#define ESTYPE_REF 14     //REF/MARK: a str repeated from how many bytes back its head is,
+                          //or (no number) a mark before a value that repeats str
+
+#define ESTINY_MAX 15
+
+#define ESEXT_MAXCODE 255
+
+// Index encoded bigints extend the widest INT encodings: after 0xFF*8
+// (0x00*8 when negative) comes a length marker that sorts after any head
+// byte, then the length and the two's complement bytes of the value
+#define ESINDEX_BIGMARK 0xF8
 
 #endif //__ESCODE_CONSTANTS_H__
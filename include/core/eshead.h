@@ -69,6 +69,11 @@ typedef struct eshead_t {
 #define ESHEAD_ENCODELEN(eshead, type, bit)                             \
   _ESHEAD_ENCODENUM(eshead, type, B(bit), 1)
 
+// Compact encodings keep a value of 0..15 in the info bits, and no number
+#define ESHEAD_ENCODETINY(eshead, type, val)                            \
+  ({(eshead)->ops = 0;                                                  \
+    ESHEAD_SETINFO(eshead, type, val);})
+
 // Floats are similar to Sign Represented Ints with MSB sign and an abs
 // value. Reverse MSB so that +ve is 1 and -ve is 0. Flip the abs value
 // for -ve numbers because lower abs value means a higher number
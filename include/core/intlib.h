@@ -37,7 +37,7 @@ typedef uint8_t byte;
 #define _NUMLG2WIDTH(num, pos)  ( 63 - __builtin_clzll(((_NUMWIDTH(num,pos)-1)<<1)+1) )
 
 
-#define FLIPIF(x, cond) (x ^ (0-B(cond)))
+#define FLIPIF(x, cond) ((x) ^ (0-B(cond)))
 #define B(x) (!!(x))
 
 
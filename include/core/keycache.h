@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Cache of decoded dict keys by their encoded bytes
+ *
+ */
+
+#ifndef __ESCODE_KEYCACHE_H__
+#define __ESCODE_KEYCACHE_H__
+
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+#include "intlib.h"
+#include "mypython.h"
+
+#define ESKEYCACHE_SIZE 256   // entries, a power of 2
+#define ESKEYCACHE_MAXLEN 64  // longer keys are not cached
+#define ESKEYCACHE_MINBLOB 2048 // smaller blobs decode without a cache
+
+/**
+ * Direct mapped: a key goes in the entry its bytes hash to, replacing
+ * whatever was there. Records repeat a small set of keys, so collisions
+ * are rare, and the cache stays bounded however many distinct keys pass.
+ * Each entry owns its str, whose hash is computed once on the way in.
+ */
+typedef struct ESKeyEntry {
+  PyObject *key;
+  uint32_t len;
+} ESKeyEntry;
+
+typedef struct ESKeyCache {
+  bool ready;
+  ESKeyEntry entries[ESKEYCACHE_SIZE];
+} ESKeyCache;
+
+/* Lazy, so a cache that is never used costs nothing to set up */
+#define ESKeyCache_INIT(cache) ((cache)->ready = 0)
+
+#define ESKeyCache_CLEAR(cache)                                         \
+  do {                                                                  \
+    if ((cache)->ready) {                                               \
+      for (int _idx = 0; _idx < ESKEYCACHE_SIZE; ++_idx) {              \
+        Py_CLEAR((cache)->entries[_idx].key);                           \
+      }                                                                 \
+    }                                                                   \
+  } while(0)
+
+// FNV-1a
+static inline uint32_t
+_eskeycache_hash(const byte* bytes, uint32_t len) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t idx = 0; idx < len; ++idx) {
+    hash = (hash ^ bytes[idx]) * 16777619u;
+  }
+  return hash;
+}
+
+/* The str for the UTF-8 bytes of a key (new reference, NULL on error).
+ * len is checked against ESKEYCACHE_MAXLEN before it is narrowed. */
+static inline PyObject*
+ESKeyCache_get(ESKeyCache* cache, const byte* bytes, uint64_t len) {
+
+  if (len > ESKEYCACHE_MAXLEN) {
+    return MyPyUnicode_FromUTF8(bytes, len);
+  }
+
+  if (!cache->ready) {
+    memset(cache->entries, 0, sizeof(cache->entries));
+    cache->ready = 1;
+  }
+
+  uint32_t hash = _eskeycache_hash(bytes, (uint32_t)len);
+  ESKeyEntry* entry = &cache->entries[hash & (ESKEYCACHE_SIZE - 1)];
+  if (entry->key && entry->len == len) {
+    const uint8_t* utf8 = MyPyUnicode_UTF8(entry->key);
+    if (utf8 && !memcmp(utf8, bytes, len)) {
+      Py_INCREF(entry->key);
+      return entry->key;
+    }
+  }
+
+  PyObject* key = MyPyUnicode_FromUTF8(bytes, len);
+  if (!key) return NULL;
+
+  // Cache the hash, and the UTF-8 that lookups compare against
+  if (PyObject_Hash(key) == -1 || !PyUnicode_AsUTF8(key)) {
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  Py_INCREF(key);
+  Py_XSETREF(entry->key, key);
+  entry->len = len;
+  return key;
+}
+
+
+#endif //__ESCODE_KEYCACHE_H__
@@ -7,11 +7,13 @@
 #include <time.h>
 #include <py3c/py3c.h>
 #include "mympdecimal.h"
+#include "utf8.h"
 
 
 
 PyObject* MyPyDec_Module;
 PyTypeObject* MyPyDec_Type;
+PyTypeObject* MyPyArray_Type;
 
 void INIT_MYPYTHON() {
   PyDateTime_IMPORT;
@@ -19,6 +21,9 @@ void INIT_MYPYTHON() {
   MyPyDec_Module = PyImport_ImportModule("decimal");
   MyPyDec_Type = (PyTypeObject*)PyObject_GetAttrString(MyPyDec_Module, "Decimal");
 #endif
+  PyObject* array = PyImport_ImportModule("array");
+  MyPyArray_Type = array ? (PyTypeObject*)PyObject_GetAttrString(array, "array") : NULL;
+  Py_XDECREF(array);
 }
 
 /**************************************************************
@@ -43,6 +48,184 @@ void INIT_MYPYTHON() {
         time->tm_hour, time->tm_min, time->tm_sec, 0);})
 
 
+/**************************************************************
+                  PYTHON LONG HELPERS
+****************************************************************/
+
+/* Since 3.12 ints of a single digit (|x| < 2**30) are "compact", and their
+ * value can be read straight from the object. Up to 3 encoded bytes is
+ * always within a single digit, so those decode through PyLong_FromLong,
+ * which serves small ints from the cache and builds the rest directly. */
+
+#if PY_VERSION_HEX >= 0x030C0000
+
+#define MyPyLong_IsCompact(ob) PyUnstable_Long_IsCompact((PyLongObject*)(ob))
+#define MyPyLong_CompactValue(ob) PyUnstable_Long_CompactValue((PyLongObject*)(ob))
+#define MyPyLong_COMPACTWIDTH 3
+
+#endif //PY_VERSION_HEX >= 0x030C0000
+
+/* Bytes in the big-endian two's complement of an int, sign bit included */
+#define MyPyLong_SIGNEDSIZE(ob) (_PyLong_NumBits(ob) / 8 + 1)
+
+#if PY_VERSION_HEX >= 0x030D0000
+#define MyPyLong_AsByteArray(ob, bytes, n, little, sign)                \
+  _PyLong_AsByteArray((PyLongObject*)(ob), bytes, n, little, sign, 1)
+#else
+#define MyPyLong_AsByteArray(ob, bytes, n, little, sign)                \
+  _PyLong_AsByteArray((PyLongObject*)(ob), bytes, n, little, sign)
+#endif //PY_VERSION_HEX >= 0x030D0000
+
+#define MyPyLong_FromByteArray(bytes, n, little, sign)                  \
+  _PyLong_FromByteArray(bytes, n, little, sign)
+
+
+/**************************************************************
+                  PYTHON UNICODE HELPERS
+****************************************************************/
+
+/**
+ * PyDict_SetItem, skipping the hash lookup for str keys that have their
+ * hash cached (as ESKeyCache keys do)
+ */
+#if PY_VERSION_HEX < 0x030D0000
+#define MyPyDict_SetItem(dict, key, val)                                \
+  ((PyUnicode_CheckExact(key) && ((PyASCIIObject*)(key))->hash != -1) ? \
+   _PyDict_SetItem_KnownHash(dict, key, val, ((PyASCIIObject*)(key))->hash) : \
+   PyDict_SetItem(dict, key, val))
+#else
+#define MyPyDict_SetItem(dict, key, val) PyDict_SetItem(dict, key, val)
+#endif //PY_VERSION_HEX < 0x030D0000
+
+/**
+ * Length of the strict UTF-8 encoding of a str, computed from its
+ * canonical representation without encoding it. Returns -1 when that is
+ * not possible (legacy strings, lone surrogates), in which case the caller
+ * should fall back to PyUnicode_AsUTF8String, which also raises the error.
+ */
+Py_ssize_t
+MyPyUnicode_UTF8Size(PyObject* str) {
+  if (PyUnicode_IS_COMPACT_ASCII(str)) { return PyUnicode_GET_LENGTH(str); }
+  if (!PyUnicode_IS_COMPACT(str)) { return -1; }
+  if (((PyCompactUnicodeObject*)str)->utf8) {
+    return ((PyCompactUnicodeObject*)str)->utf8_length;
+  }
+
+  Py_ssize_t len = PyUnicode_GET_LENGTH(str);
+  Py_ssize_t size = len;
+  const void* data = PyUnicode_DATA(str);
+
+  switch (PyUnicode_KIND(str)) {
+    case PyUnicode_1BYTE_KIND: {
+      const Py_UCS1* chars = (const Py_UCS1*)data;
+      for (Py_ssize_t idx = 0; idx < len; ++idx) {
+        size += chars[idx] >> 7;
+      }
+      break;
+    }
+    case PyUnicode_2BYTE_KIND: {
+      const Py_UCS2* chars = (const Py_UCS2*)data;
+      for (Py_ssize_t idx = 0; idx < len; ++idx) {
+        Py_UCS2 ch = chars[idx];
+        if (ch < 0x80) { continue; }
+        if (Py_UNICODE_IS_SURROGATE(ch)) { return -1; }
+        size += 1 + (ch >= 0x800);
+      }
+      break;
+    }
+    default: {
+      const Py_UCS4* chars = (const Py_UCS4*)data;
+      for (Py_ssize_t idx = 0; idx < len; ++idx) {
+        Py_UCS4 ch = chars[idx];
+        if (ch < 0x80) { continue; }
+        if (Py_UNICODE_IS_SURROGATE(ch)) { return -1; }
+        size += 1 + (ch >= 0x800) + (ch >= 0x10000);
+      }
+      break;
+    }
+  }
+
+  return size;
+}
+
+
+/**
+ * The UTF-8 of a str when it is available without encoding: compact ASCII
+ * strings are their own UTF-8, others may have it cached. NULL otherwise.
+ */
+#define MyPyUnicode_UTF8(str)                                           \
+  (PyUnicode_IS_COMPACT_ASCII(str) ?                                    \
+   (const uint8_t*)PyUnicode_DATA(str) :                                   \
+   PyUnicode_IS_COMPACT(str) ?                                          \
+   (const uint8_t*)((PyCompactUnicodeObject*)(str))->utf8 : NULL)
+
+#define _MyPyUnicode_WRITEUTF8(type, data, len, out)                    \
+  do {                                                                  \
+    const type* _chars = (const type*)(data);                           \
+    for (Py_ssize_t _idx = 0; _idx < (len); ++_idx) {                   \
+      Py_UCS4 _ch = _chars[_idx];                                       \
+      if (_ch < 0x80) {                                                 \
+        *(out)++ = (uint8_t)_ch;                                           \
+      } else if (_ch < 0x800) {                                         \
+        *(out)++ = (uint8_t)(0xC0 | (_ch >> 6));                           \
+        *(out)++ = (uint8_t)(0x80 | (_ch & 0x3F));                         \
+      } else if (_ch < 0x10000) {                                       \
+        *(out)++ = (uint8_t)(0xE0 | (_ch >> 12));                          \
+        *(out)++ = (uint8_t)(0x80 | ((_ch >> 6) & 0x3F));                  \
+        *(out)++ = (uint8_t)(0x80 | (_ch & 0x3F));                         \
+      } else {                                                          \
+        *(out)++ = (uint8_t)(0xF0 | (_ch >> 18));                          \
+        *(out)++ = (uint8_t)(0x80 | ((_ch >> 12) & 0x3F));                 \
+        *(out)++ = (uint8_t)(0x80 | ((_ch >> 6) & 0x3F));                  \
+        *(out)++ = (uint8_t)(0x80 | (_ch & 0x3F));                         \
+      }                                                                 \
+    }                                                                   \
+  } while(0)
+
+/**
+ * Transcode a compact str into UTF-8 at out, which must have room for
+ * MyPyUnicode_UTF8Size(str) bytes (so the str has no lone surrogates).
+ */
+void
+MyPyUnicode_WriteUTF8(PyObject* str, uint8_t* out) {
+  Py_ssize_t len = PyUnicode_GET_LENGTH(str);
+  const void* data = PyUnicode_DATA(str);
+
+  switch (PyUnicode_KIND(str)) {
+    case PyUnicode_1BYTE_KIND:
+      _MyPyUnicode_WRITEUTF8(Py_UCS1, data, len, out); break;
+    case PyUnicode_2BYTE_KIND:
+      _MyPyUnicode_WRITEUTF8(Py_UCS2, data, len, out); break;
+    default:
+      _MyPyUnicode_WRITEUTF8(Py_UCS4, data, len, out); break;
+  }
+}
+
+
+/* A str from bytes already known to be ASCII, copied without a check */
+PyObject*
+MyPyUnicode_FromASCII(const uint8_t* str, Py_ssize_t len) {
+  PyObject* result = PyUnicode_New(len, 0x7F);
+  if (result) memcpy(PyUnicode_1BYTE_DATA(result), str, len);
+  return result;
+}
+
+/**
+ * A str from strict UTF-8. ASCII, found with SIMD where available, is
+ * copied straight into a compact ASCII str; the rest goes through
+ * PyUnicode_DecodeUTF8, which also raises the error for invalid input.
+ */
+PyObject*
+MyPyUnicode_FromUTF8(const uint8_t* str, Py_ssize_t len) {
+  uint64_t ascii = esutf8_asciilen(str, len);
+  if (ascii == (uint64_t)len) {
+    return MyPyUnicode_FromASCII(str, len);
+  }
+
+  return PyUnicode_DecodeUTF8((const char*)str, len, "strict");
+}
+
+
 /* PyDict_GET_SIZE is available since Python 3.3 */
 
 
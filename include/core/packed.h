@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Packed arrays: lists of numbers or bools written as one raw block
+ * instead of a head per item
+ *
+ */
+
+#ifndef __ESCODE_PACKED_H__
+#define __ESCODE_PACKED_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "intlib.h"
+
+/**
+ * An ESTYPE_ARRAY value is a head with the item count, a byte with the
+ * element code (the array.array typecode of the items), then the items
+ * little endian, width bytes each, or for bools 8 to a byte from the
+ * lowest bit up.
+ */
+#define ESARRAY_BOOL '?'
+#define ESARRAY_INT8 'b'
+#define ESARRAY_INT16 'h'
+#define ESARRAY_INT32 'i'
+#define ESARRAY_INT64 'q'
+#define ESARRAY_UINT8 'B'
+#define ESARRAY_UINT16 'H'
+#define ESARRAY_UINT32 'I'
+#define ESARRAY_UINT64 'Q'
+#define ESARRAY_FLOAT32 'f'
+#define ESARRAY_FLOAT64 'd'
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ESARRAY_SWAPPED 1
+#define _ESARRAY_LE(x, bits) __builtin_bswap##bits(x)
+#else
+#define ESARRAY_SWAPPED 0
+#define _ESARRAY_LE(x, bits) (x)
+#endif
+
+/* Bytes per item of an element code, 0 for bools, -1 if unknown */
+static inline int
+esarray_width(byte code) {
+  switch (code) {
+  case ESARRAY_BOOL: return 0;
+  case ESARRAY_INT8: case ESARRAY_UINT8: return 1;
+  case ESARRAY_INT16: case ESARRAY_UINT16: return 2;
+  case ESARRAY_INT32: case ESARRAY_UINT32: case ESARRAY_FLOAT32: return 4;
+  case ESARRAY_INT64: case ESARRAY_UINT64: case ESARRAY_FLOAT64: return 8;
+  }
+  return -1;
+}
+
+/* Length of the data of count items of width (see esarray_width, which
+ * callers check is not -1) */
+#define esarray_datalen(width, count)                                   \
+  ((width) ? (uint64_t)(width) * (uint64_t)(count) : ((uint64_t)(count) + 7) / 8)
+
+/* The most items of width that fit in len bytes */
+#define esarray_maxcount(width, len)                                    \
+  ((width) ? (uint64_t)(len) / (uint64_t)(width) :                      \
+   (uint64_t)(len) > UINT64_MAX / 8 ? UINT64_MAX : (uint64_t)(len) * 8)
+
+/* Store the low width bytes of num at out, little endian */
+static inline void
+esarray_put(byte* out, uint64_t num, int width) {
+  switch (width) {
+  case 1: *out = (byte)num; break;
+  case 2: { uint16_t le = _ESARRAY_LE((uint16_t)num, 16); memcpy(out, &le, 2); break; }
+  case 4: { uint32_t le = _ESARRAY_LE((uint32_t)num, 32); memcpy(out, &le, 4); break; }
+  case 8: { uint64_t le = _ESARRAY_LE(num, 64); memcpy(out, &le, 8); break; }
+  }
+}
+
+/* The width bytes at in, little endian and zero extended */
+static inline uint64_t
+esarray_getu(const byte* in, int width) {
+  switch (width) {
+  case 1: return *in;
+  case 2: { uint16_t le; memcpy(&le, in, 2); return _ESARRAY_LE(le, 16); }
+  case 4: { uint32_t le; memcpy(&le, in, 4); return _ESARRAY_LE(le, 32); }
+  }
+  uint64_t le;
+  memcpy(&le, in, 8);
+  return _ESARRAY_LE(le, 64);
+}
+
+/* The width bytes at in, little endian and sign extended */
+static inline int64_t
+esarray_get(const byte* in, int width) {
+  switch (width) {
+  case 1: return (int8_t)*in;
+  case 2: return (int16_t)esarray_getu(in, 2);
+  case 4: return (int32_t)esarray_getu(in, 4);
+  }
+  return (int64_t)esarray_getu(in, 8);
+}
+
+/* The narrowest integer element code holding min..max */
+static inline byte
+esarray_intcode(int64_t min, int64_t max) {
+  if (min >= INT8_MIN && max <= INT8_MAX) return ESARRAY_INT8;
+  if (min >= INT16_MIN && max <= INT16_MAX) return ESARRAY_INT16;
+  if (min >= INT32_MIN && max <= INT32_MAX) return ESARRAY_INT32;
+  return ESARRAY_INT64;
+}
+
+
+#endif //__ESCODE_PACKED_H__
@@ -1,86 +1,92 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Growable stack of fixed size items, kept in inline storage (usually on
+ * the C stack) until it outgrows it
+ *
+ */
+
+#ifndef __STACK_H__
+#define __STACK_H__
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
-#include <assert.h>
 
 #ifndef VECTOR_DEFAULT_SIZE
 #define VECTOR_DEFAULT_SIZE 10
 #endif
 
-typedef struct Vector {
-  void **_arr;
-  uint8_t ops;
-  uint32_t offset;
-  uint32_t size;
-  uint32_t maxsize;
-  void* _stackarr[VECTOR_DEFAULT_SIZE];
-} Vector;
+/* Declare a vector type holding items of type, with len inline slots */
+#define VECTOR_TYPE(name, type, len)                                    \
+  typedef struct name {                                                 \
+    uint32_t offset;                                                    \
+    uint32_t size;                                                      \
+    type *_arr;                                                         \
+    type *_heaparr;                                                     \
+    type _stackarr[len];                                                \
+  } name
 
+VECTOR_TYPE(Vector, void*, VECTOR_DEFAULT_SIZE);
 
-#define Vector_INIT(vec, len)                                           \
-  ({memset(vec, 0, offsetof(Vector, _stackarr));                        \
-    (vec)->size = VECTOR_DEFAULT_SIZE;                                  \
-    (vec)->maxsize = UINT32_MAX;                                        \
-                                                                        \
-    if (len > (vec)->size) {                                            \
-      (vec)->size = len;                                                \
-      (vec)->_arr = malloc(sizeof(void*) * len);                        \
-      assert((vec)->_arr);                                              \
-    }})
 
-#define Vector_FREE(vec)                                               \
-  if ((vec)->_arr) { free((vec)->_arr); (vec)->_arr = NULL;}           \
+#define Vector_INIT(vec)                                                \
+  ({(vec)->offset = 0;                                                  \
+    (vec)->size = sizeof((vec)->_stackarr) / sizeof(*(vec)->_stackarr); \
+    (vec)->_arr = (vec)->_stackarr;                                     \
+    (vec)->_heaparr = NULL;                                             \
+    vec;})
 
-
-#define Vector_PUSH(vec, item)                                         \
-  ({void** _arr = Vector_PREPARE(vec, 1);                              \
-    _arr[(vec)->offset++] = (void*)(item);                             \
-    1;})
-
-#define Vector_POP(vec, type)                                          \
-  ((type*)((vec)->offset ? Vector_ARR(vec)[--(vec)->offset] : NULL))
+#define Vector_FREE(vec)                                                \
+  if ((vec)->_heaparr) {                                                \
+    free((vec)->_heaparr);                                              \
+    (vec)->_heaparr = NULL;                                             \
+  }                                                                     \
 
 #define Vector_LEN(vec) ((vec)->offset)
 
-#define Vector_ARR(vec)                                                \
-  ((vec)->size > VECTOR_DEFAULT_SIZE ? (vec)->_arr : (vec)->_stackarr)
+#define Vector_AT(vec, idx) (&(vec)->_arr[idx])
 
+/* Top item, or NULL when empty */
+#define Vector_TOP(vec)                                                 \
+  ((vec)->offset ? &(vec)->_arr[(vec)->offset-1] : NULL)
 
-/**
- * Change the allocation of the vector to the new size. The first time
- * Vector_RESIZE is called, we move over from _stackarr to the
- * allocated _arr, even if _newsize is smaller and _stackarr has room
- */
+/* Remove the top item and return it (valid till the next push) or NULL */
+#define Vector_POP(vec)                                                 \
+  ((vec)->offset ? &(vec)->_arr[--(vec)->offset] : NULL)
+
+/* Add an item and return it (uninitialized), or NULL if out of memory */
+#define Vector_PUSH(vec)                                                \
+  (((vec)->offset < (vec)->size || _Vector_GROW(vec)) ?                 \
+   &(vec)->_arr[(vec)->offset++] : NULL)
 
-#define Vector_RESIZE(vec, _newsize)                                    \
-  ({void** _oldarr = NULL;                                              \
-    if (!(vec)->_arr) {                                                 \
-      /* Moving from _stackarr to allocated _arr */                     \
-      (vec)->_arr = malloc(sizeof(void*) * _newsize);                   \
-      assert((vec)->_arr);                                              \
-      memcpy((vec)->_arr, (vec)->_stackarr, sizeof(void*) * (vec)->offset); \
-    } else {                                                            \
-      /* Reallocating to new size (can be smaller) */                   \
-      _oldarr = (vec)->_arr;                                            \
-      (vec)->_arr = realloc((vec)->_arr, sizeof(void*) * _newsize);     \
-      assert((vec)->_arr);                                              \
-    }                                                                   \
-    (vec)->size = _newsize;                                             \
-    (vec)->_arr;})
 
 /**
- * Check whether there is enough space in the vecfer. If not, calculate
- * a new size based on limits defined and call Vector_resize
+ * Double the allocation of the vector. The first time _Vector_GROW is
+ * called, we move over from _stackarr to the allocated _heaparr.
+ * Evaluates to 0 (leaving the vector untouched) if out of memory.
  */
-#define Vector_PREPARE(vec, len)                                        \
-  ({uint32_t _requiredsize = (vec)->offset + len;                       \
-    assert(_requiredsize <= (vec)->maxsize);                            \
-                                                                        \
-    if ((vec)->size < _requiredsize) {                                  \
-      uint32_t _newsize = (vec)->size * 2;                              \
-      if (_newsize < _requiredsize) { _newsize = _requiredsize; }       \
-      else if (_newsize > (vec)->maxsize) { _newsize = (vec)->maxsize; } \
-      Vector_RESIZE(vec, _newsize);                                     \
+#define _Vector_GROW(vec)                                               \
+  ({size_t _itemsize = sizeof(*(vec)->_arr);                            \
+    size_t _newsize = (size_t)(vec)->size * 2;                          \
+    void* _newarr = NULL;                                               \
+    if (_newsize <= UINT32_MAX) {                                       \
+      if (!(vec)->_heaparr) {                                           \
+        /* Moving from _stackarr to allocated _heaparr */               \
+        _newarr = malloc(_itemsize * _newsize);                         \
+        if (_newarr) {                                                  \
+          memcpy(_newarr, (vec)->_stackarr, _itemsize * (vec)->offset); \
+        }                                                               \
+      } else {                                                          \
+        _newarr = realloc((vec)->_heaparr, _itemsize * _newsize);       \
+      }                                                                 \
     }                                                                   \
-    Vector_ARR(vec);})
+    if (_newarr) {                                                      \
+      (vec)->_arr = (vec)->_heaparr = _newarr;                          \
+      (vec)->size = _newsize;                                           \
+    }                                                                   \
+    _newarr != NULL;})
+
+#endif //__STACK_H__
@@ -9,6 +9,7 @@
 #ifndef __STRBUF_H__
 #define __STRBUF_H__
 
+#include <Python.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -24,15 +25,17 @@
 
 typedef struct ESReader {
   const byte *str;
-  uint32_t offset;
-  const uint32_t size;
+  uint64_t offset;
+  const uint64_t size;
 } ESReader;
 
 #define ESReader_cursor(buf)                    \
   ((buf)->str + (buf)->offset)
 
+// len may come from the input, so compare without overflowing offset + len
+// (as unsigned: a negative len fails)
 #define ESReader_read(buf, len)                                     \
-  ({esread_assert((buf)->size >= (buf)->offset + (len));            \
+  ({esread_assert((uint64_t)(len) <= (buf)->size - (buf)->offset);  \
     const byte* _bytes = ESReader_cursor(buf);                      \
     (buf)->offset += (len);                                         \
     _bytes;})
@@ -55,21 +58,27 @@ typedef struct ESReader {
 
 typedef struct ESWriter {
   uint8_t ops;
-  uint32_t offset;
-  uint32_t size;
-  uint32_t maxsize;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t maxsize;
   byte *_str;
   byte *_heapstr;
+  PyObject *_bytes;
   byte _stackstr[512];
 
 } ESWriter;
 
+// The most a writer holds: the largest bytes object
+#define ESWRITER_MAXSIZE ((uint64_t)PY_SSIZE_T_MAX)
+
 #define OP_STRBUFINDEX 0x01
+#define OP_STRBUFBYTES 0x02
+#define OP_STRBUFSIZE 0x04
 
 #define ESWriter_init(buf, len)                                         \
   ({memset(buf, 0, offsetof(ESWriter, _stackstr));                      \
     (buf)->size = sizeof((buf)->_stackstr);                             \
-    (buf)->maxsize = UINT32_MAX;                                        \
+    (buf)->maxsize = ESWRITER_MAXSIZE;                                  \
     (buf)->_str = (buf)->_stackstr;                                     \
                                                                         \
     if ((len) > (buf)->size) {                                          \
@@ -78,15 +87,88 @@ typedef struct ESWriter {
       eswrite_assert((buf)->_heapstr);                                  \
     }})
 
+/**
+ * Like ESWriter_init, but once the output outgrows _stackstr it is grown
+ * in place inside a PyBytesObject, so ESWriter_finish can hand that object
+ * back (shrunk to fit) instead of copying the whole buffer into a new one.
+ */
+#define ESWriter_initbytes(buf, len)                                    \
+  ({memset(buf, 0, offsetof(ESWriter, _stackstr));                      \
+    (buf)->ops = OP_STRBUFBYTES;                                        \
+    (buf)->size = sizeof((buf)->_stackstr);                             \
+    (buf)->maxsize = ESWRITER_MAXSIZE;                                  \
+    (buf)->_str = (buf)->_stackstr;                                     \
+                                                                        \
+    if ((len) > (buf)->size) {                                          \
+      (buf)->_bytes = PyBytes_FromStringAndSize(NULL, (len));           \
+      eswrite_assert((buf)->_bytes);                                    \
+      (buf)->size = (len);                                              \
+      (buf)->_str = (byte*)PyBytes_AS_STRING((buf)->_bytes);            \
+    }})
+
+// Outputs longer than this are not learnt: they grow the buffer as usual
+#define ESWRITER_HINTMAX ((uint64_t)1 << 20)
+
+/**
+ * Adapt a size hint for ESWriter_initbytes to recent output lengths: jump
+ * up (with some slack) to a longer one, and decay by 1/8 of the gap
+ * towards shorter ones, so an occasional small output keeps the hint.
+ * A single huge output would otherwise presize every call after it.
+ */
+#define ESWriter_learnsize(hint, len)                                   \
+  do {                                                                  \
+    uint64_t _want = (len) + ((len) >> 3);                              \
+    if (_want > ESWRITER_MAXSIZE) _want = ESWRITER_MAXSIZE;             \
+    if ((len) <= ESWRITER_HINTMAX) {                                    \
+      (hint) = (_want >= (hint) ?                                       \
+                _want : (hint) - (((hint) - _want) >> 3));              \
+    }                                                                   \
+  } while(0)
+
+/**
+ * Write into len bytes of caller owned memory at str. The writer can not
+ * grow: maxsize is len, so running out of room fails like any other
+ * maxsize overflow, without an exception set.
+ */
+#define ESWriter_initfixed(buf, str, len)                               \
+  ({memset(buf, 0, offsetof(ESWriter, _stackstr));                      \
+    (buf)->size = (buf)->maxsize = (len);                               \
+    (buf)->_str = (str);})
+
+/**
+ * A sizing writer stores nothing and never allocates: writes only advance
+ * offset, which ends up as the exact length the same encode would produce.
+ */
+#define ESWriter_initsize(buf)                                          \
+  ({memset(buf, 0, offsetof(ESWriter, _stackstr));                      \
+    (buf)->ops = OP_STRBUFSIZE;                                         \
+    (buf)->size = (buf)->maxsize = ESWRITER_MAXSIZE;})
+
+#define ESWriter_sizing(buf) ((buf)->ops & OP_STRBUFSIZE)
+
 #define ESWriter_free(buf)                                              \
   if ((buf)->_heapstr) {                                                \
     free((buf)->_heapstr);                                              \
     (buf)->_heapstr = NULL;                                             \
   }                                                                     \
+  Py_CLEAR((buf)->_bytes);                                              \
 
-
+/**
+ * A writer that has grown into its own PyBytesObject returns it shrunk to
+ * the written length. Otherwise the contents are passed to cb to build the
+ * result (e.g. PyBytes_FromStringAndSize from _stackstr).
+ */
 #define ESWriter_finish(buf, cb)                                        \
-  ({void* _obj = cb((char*)(buf)->_str, (buf)->offset);                 \
+  ({void* _obj;                                                         \
+    if ((buf)->_bytes) {                                                \
+      _obj = (buf)->_bytes;                                             \
+      (buf)->_bytes = NULL;                                             \
+      if (_PyBytes_Resize((PyObject**)&_obj, (buf)->offset) < 0) {      \
+        _obj = NULL;                                                    \
+      }                                                                 \
+    } else {                                                            \
+      _obj = cb((char*)(buf)->_str, (buf)->offset);                     \
+    }                                                                   \
     ESWriter_free(buf);                                                 \
     _obj;})
 
@@ -100,23 +182,39 @@ typedef struct ESWriter {
 /**
  * Change the allocation of the buffer to the new size. The first time
  * _ESWriter_resize is called, we move over from _stackstr to the
- *  _heapstr, even if _newsize is smaller and _stackstr has room
+ *  _heapstr, even if _newsize is smaller and _stackstr has room.
+ *  With OP_STRBUFBYTES the same applies, but with _bytes in place of
+ *  _heapstr.
  */
 
 #define _ESWriter_resize(buf, _newsize)                                 \
   do {                                                                  \
-    if (!(buf)->_heapstr) {                                             \
-      /* Moving from _stackstr to _heapstr */                           \
-      (buf)->_heapstr = (byte*)malloc(sizeof(byte) * _newsize);         \
-      eswrite_assert((buf)->_heapstr);                                  \
-      memcpy((buf)->_heapstr, (buf)->_stackstr, sizeof(byte) * (buf)->offset); \
+    if ((buf)->ops & OP_STRBUFBYTES) {                                  \
+      if (!(buf)->_bytes) {                                             \
+        /* Moving from _stackstr to _bytes */                           \
+        (buf)->_bytes = PyBytes_FromStringAndSize(NULL, _newsize);      \
+        eswrite_assert((buf)->_bytes);                                  \
+        memcpy(PyBytes_AS_STRING((buf)->_bytes), (buf)->_stackstr,      \
+               sizeof(byte) * (buf)->offset);                           \
+      } else {                                                          \
+        /* Resizing in place (_bytes is released on failure) */         \
+        eswrite_assert(!_PyBytes_Resize(&(buf)->_bytes, _newsize));     \
+      }                                                                 \
+      (buf)->_str = (byte*)PyBytes_AS_STRING((buf)->_bytes);            \
     } else {                                                            \
-      /* Reallocating to new size (can be smaller) */                   \
-      (buf)->_heapstr = (byte*)realloc((buf)->_heapstr, sizeof(byte) * _newsize); \
-      eswrite_assert((buf)->_heapstr);                                  \
+      if (!(buf)->_heapstr) {                                           \
+        /* Moving from _stackstr to _heapstr */                         \
+        (buf)->_heapstr = (byte*)malloc(sizeof(byte) * _newsize);       \
+        eswrite_assert((buf)->_heapstr);                                \
+        memcpy((buf)->_heapstr, (buf)->_stackstr, sizeof(byte) * (buf)->offset); \
+      } else {                                                          \
+        /* Reallocating to new size (can be smaller) */                 \
+        (buf)->_heapstr = (byte*)realloc((buf)->_heapstr, sizeof(byte) * _newsize); \
+        eswrite_assert((buf)->_heapstr);                                \
+      }                                                                 \
+      (buf)->_str = (buf)->_heapstr;                                    \
     }                                                                   \
     (buf)->size = _newsize;                                             \
-    (buf)->_str = (buf)->_heapstr;                                      \
   } while(0)
 
 /**
@@ -125,15 +223,14 @@ typedef struct ESWriter {
  */
 #define ESWriter_prepare(buf, len)                                      \
   do {                                                                  \
-    uint32_t _requiredsize = (buf)->offset + (len);                     \
-    eswrite_assert(_requiredsize <= (buf)->maxsize);                    \
+    eswrite_assert((uint64_t)(len) <= (buf)->maxsize - (buf)->offset);  \
+    uint64_t _requiredsize = (buf)->offset + (len);                     \
                                                                         \
     if ((buf)->size < _requiredsize) {                                  \
-      uint32_t _newsize = (buf)->size * 2;                              \
+      uint64_t _newsize = ((buf)->size > (buf)->maxsize / 2 ?           \
+                           (buf)->maxsize : (buf)->size * 2);           \
       if (_newsize < _requiredsize) {                                   \
-        _newsize = _requiredsize; }                                     \
-      else if (_newsize > (buf)->maxsize) {                             \
-        _newsize = (buf)->maxsize;                                      \
+        _newsize = _requiredsize;                                       \
       }                                                                 \
       _ESWriter_resize(buf, _newsize);                                  \
     }                                                                   \
@@ -153,6 +250,7 @@ typedef struct ESWriter {
   } while(0)
 
 
+/* The returned cursor must not be written to by a sizing writer */
 #define ESWriter_alloc(buf, len)                                        \
   ({ESWriter_prepare(buf, len);                                         \
     (buf)->offset += (len);                                             \
@@ -163,7 +261,9 @@ typedef struct ESWriter {
   do {                                                                  \
     if ((len) && (contents)) {                                          \
       ESWriter_prepare(buf, len);                                       \
-      memcpy(ESWriter_cursor(buf), contents, (len));                    \
+      if (!ESWriter_sizing(buf)) {                                      \
+        memcpy(ESWriter_cursor(buf), contents, (len));                  \
+      }                                                                 \
       (buf)->offset += (len);                                           \
     }                                                                   \
   } while(0)
@@ -181,14 +281,14 @@ typedef struct ESWriter {
 int
 ESWriter_write_index(ESWriter* buf, const byte* contents, const uint64_t len) {
   if (len && contents) {
-    uint32_t _newlen = len; //TODO: Downcast?
+    uint64_t _newlen = len;
     const byte* pending = NULL;
 
     /* Trailing \x00s are stripped for index writes */
     while (_newlen > 0 && !contents[_newlen-1]) {--_newlen;}
     ESWriter_prepare(buf, _newlen);
 
-    for(uint32_t _idx = 0; _idx < _newlen; ++_idx) {
+    for(uint64_t _idx = 0; _idx < _newlen; ++_idx) {
       /* Keep popping till we reach a non-\x00 byte or exhaust 255 */
       /* \x00s. Also since all trailing \x00s were stripped, we    */
       /* never reach the  end of the content                       */
@@ -202,9 +302,12 @@ ESWriter_write_index(ESWriter* buf, const byte* contents, const uint64_t len) {
           pending = NULL;
         }
 
-        _x00count = ~_x00count + 1;
-        (buf)->_str[(buf)->offset++] = 0x00;
-        (buf)->_str[(buf)->offset++] = _x00count;
+        /* A lone \x00 escapes to two bytes, so this can outgrow _newlen */
+        byte* _cursor = ESWriter_alloc(buf, 2);
+        if (!ESWriter_sizing(buf)) {
+          _cursor[0] = 0x00;
+          _cursor[1] = ~_x00count + 1;
+        }
         --_idx; /* Back to non-\x00 byte or the UINT8_MAX-th \x00*/
       } else if (!pending) {
         pending = contents + _idx;
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Lookup tables: an optional prefix to a list/tuple or dict with where
+ * each of its items starts, for constant time indexing into an encoding
+ * and logarithmic time dict lookups by key
+ *
+ */
+
+#ifndef __ESCODE_TABLE_H__
+#define __ESCODE_TABLE_H__
+
+#include <stdint.h>
+#include "intlib.h"
+#include "constants.h"
+#include "eshead.h"
+#include "strbuf.h"
+
+/**
+ * A table is a value of type ESTYPE_TABLE (bit set for a dict's) whose
+ * head number is the length of what follows: a byte with the width of
+ * each offset, then one entry per item. A list entry is the big-endian
+ * offset of the item from the container's first item; a dict entry is
+ * the 4 byte big-endian estable_hash of the key's encoding then the
+ * offset of the key, sorted by hash (and offset). The container comes
+ * right after it, so readers that do not use the table just skip it.
+ */
+typedef struct ESTable {
+  const byte* entries;
+  uint64_t count;
+  byte width;  // 0 if the table does not fit its container
+  bool keyed;
+} ESTable;
+
+#define ESTABLE_HASHWIDTH 4
+
+#define ESTable_ENTRYSIZE(table) ((table)->width + ESTABLE_HASHWIDTH * (table)->keyed)
+
+/* FNV-1a of an encoded key */
+static inline uint32_t
+estable_hash(const byte* str, uint64_t len) {
+  uint32_t hash = 0x811C9DC5;
+  for (uint64_t idx = 0; idx < len; ++idx) {
+    hash = (hash ^ str[idx]) * 0x01000193;
+  }
+  return hash;
+}
+
+static inline uint64_t
+estable_readnum(const byte* bytes, byte width) {
+  uint64_t num = 0;
+  for (byte idx = 0; idx < width; ++idx) {
+    num = (num << 8) | bytes[idx];
+  }
+  return num;
+}
+
+static inline void
+estable_writenum(byte* bytes, uint64_t num, byte width) {
+  for (byte idx = width; idx; --idx) {
+    bytes[idx - 1] = (byte)num;
+    num >>= 8;
+  }
+}
+
+/* The fewest bytes, of 1, 2, 4 or 8, that hold num */
+static inline byte
+estable_width(uint64_t num) {
+  return (num <= UINT8_MAX ? 1 : num <= UINT16_MAX ? 2 :
+          num <= UINT32_MAX ? 4 : 8);
+}
+
+/* Offset of item idx from the container's first item */
+#define estable_offset(table, idx)                                      \
+  estable_readnum((table)->entries + (idx) * ESTable_ENTRYSIZE(table) + \
+                  ESTABLE_HASHWIDTH * (table)->keyed, (table)->width)
+
+#define estable_hashat(table, idx)                                      \
+  ((uint32_t)estable_readnum((table)->entries + (idx) * ESTable_ENTRYSIZE(table), \
+                             ESTABLE_HASHWIDTH))
+
+/* First entry of a dict's table whose hash is not below hash */
+static inline uint64_t
+estable_find(ESTable* table, uint32_t hash) {
+  uint64_t lo = 0, hi = table->count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (estable_hashat(table, mid) < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * Read the table at buf into table and check it against the head of the
+ * container after it, leaving buf at that head. Returns the new cursor,
+ * or NULL if the input ends first. A table that does not fit (another
+ * type follows, or its length is not the container's count of entries)
+ * is read with a width of 0.
+ */
+static inline const byte*
+estable_read(ESReader* buf, ESTable* table) {
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+
+  byte headbyte = ESReader_readtype(buf, byte);
+  ESHEAD_INITDECODE(eshead, headbyte);
+  const byte* bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+  table->keyed = ESHEAD_DECODELEN(eshead, bytes);
+  uint64_t len = eshead->val.u64;
+  table->entries = ESReader_read(buf, len);
+  table->width = 0;
+  table->count = 0;
+
+  // Peek at the container's head
+  ESReader next = *buf;
+  headbyte = ESReader_readtype(&next, byte);
+  ESHEAD_INITDECODE(eshead, headbyte);
+  byte type = ESHEAD_GETTYPE(eshead);
+  if (type != (table->keyed ? ESTYPE_SET : ESTYPE_LIST) ||
+      ESHEAD_GETBIT(eshead) < table->keyed || !len) {
+    return ESReader_cursor(buf);
+  }
+  bytes = ESReader_read(&next, ESHEAD_GETNUMWIDTH(eshead, 1));
+  ESHEAD_DECODELEN(eshead, bytes);
+
+  byte width = *table->entries++;
+  uint64_t entrysize = width + ESTABLE_HASHWIDTH * table->keyed;
+  if ((width == 1 || width == 2 || width == 4 || width == 8) &&
+      eshead->val.u64 <= (len - 1) / entrysize &&
+      eshead->val.u64 * entrysize == len - 1) {
+    table->width = width;
+    table->count = eshead->val.u64;
+  }
+  return ESReader_cursor(buf);
+}
+
+
+#endif //__ESCODE_TABLE_H__
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * UTF-8 validation, without the GIL or any Python objects
+ *
+ */
+
+#ifndef __ESCODE_UTF8_H__
+#define __ESCODE_UTF8_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "intlib.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Length of the ASCII prefix of str, checked 32 (AVX2) or 16 (SSE2) bytes
+ * at a time where the build targets them, else 8 at a time.
+ */
+static inline uint64_t
+esutf8_asciilen(const byte* str, uint64_t len) {
+  uint64_t pos = 0;
+
+#if defined(__AVX2__)
+  for (; len - pos >= 32; pos += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(str + pos));
+    uint32_t high = (uint32_t)_mm256_movemask_epi8(chunk);
+    if (high) return pos + __builtin_ctz(high);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; len - pos >= 16; pos += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(str + pos));
+    uint32_t high = (uint32_t)_mm_movemask_epi8(chunk);
+    if (high) return pos + __builtin_ctz(high);
+  }
+#endif
+  for (; len - pos >= 8; pos += 8) {
+    uint64_t word;
+    memcpy(&word, str + pos, sizeof(word));
+    if (word & 0x8080808080808080ULL) break;
+  }
+  while (pos < len && str[pos] < 0x80) ++pos;
+  return pos;
+}
+
+/**
+ * Whether str holds well formed UTF-8 as Python's strict decoder takes
+ * it: no overlong forms, surrogates or code points above U+10FFFF. ASCII
+ * runs are skipped with esutf8_asciilen.
+ */
+static inline bool
+esutf8_valid(const byte* str, uint64_t len) {
+  uint64_t pos = 0;
+
+  while (pos < len) {
+    byte lead = str[pos];
+    if (lead < 0x80) {
+      uint64_t run = esutf8_asciilen(str + pos, len - pos);
+      pos += run;
+      continue;
+    }
+
+    // The second byte's allowed range excludes overlong forms, surrogates
+    // and code points above U+10FFFF; later bytes are plain continuations
+    uint32_t ch;
+    uint64_t left = len - pos;
+    const byte* cur = str + pos;
+#define _ESUTF8_CONT(b) (((b) & 0xC0) == 0x80)
+    if (lead >= 0xC2 && lead <= 0xDF) {
+      if (left < 2 || !_ESUTF8_CONT(cur[1])) return 0;
+      ch = ((lead & 0x1F) << 6) | (cur[1] & 0x3F);
+      pos += 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+      if (left < 3 || !_ESUTF8_CONT(cur[1]) || !_ESUTF8_CONT(cur[2])) return 0;
+      ch = ((lead & 0x0F) << 12) | ((cur[1] & 0x3F) << 6) | (cur[2] & 0x3F);
+      if (ch < 0x800 || (ch >= 0xD800 && ch <= 0xDFFF)) return 0;
+      pos += 3;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+      if (left < 4 || !_ESUTF8_CONT(cur[1]) || !_ESUTF8_CONT(cur[2]) ||
+          !_ESUTF8_CONT(cur[3])) return 0;
+      ch = ((lead & 0x07) << 18) | ((cur[1] & 0x3F) << 12) |
+        ((cur[2] & 0x3F) << 6) | (cur[3] & 0x3F);
+      if (ch < 0x10000 || ch > 0x10FFFF) return 0;
+      pos += 4;
+    } else {
+      return 0;
+    }
+#undef _ESUTF8_CONT
+  }
+  return 1;
+}
+
+
+#endif //__ESCODE_UTF8_H__
@@ -9,26 +9,275 @@
 #ifndef __ESCODE_DECODER_H__
 #define __ESCODE_DECODER_H__
 
+#include "core/mypython.h"
 #include "core/strbuf.h"
 #include "core/constants.h"
 #include "core/eshead.h"
+#include "core/stack.h"
+#include "core/keycache.h"
+#include "core/utf8.h"
+#include "core/table.h"
+#include "core/packed.h"
 #include "escode.h"
+#include "registry.h"
 
-/* Forward declaration so the recursive descent below routes back through
- * decode_object(), which guards each level against unbounded recursion. */
-static inline PyObject* decode_object(ESReader* buf);
+/* A str decoded from a value after a dedup mark, and its head's offset */
+typedef struct ESDecodeStr {
+  uint64_t head;
+  PyObject *obj;
+} ESDecodeStr;
 
+VECTOR_TYPE(ESDecodeStrs, ESDecodeStr, 16);
+
+/**
+ * Settings and state for one decode. Dict keys go through keys if set.
+ * Bytes of viewmin or more (if set) are returned as read-only memoryview
+ * slices of view, a memoryview of source (what buf reads) made on first
+ * use, which keeps source alive for as long as any slice is. With
+ * twostage, the input is first scanned without the GIL (see tape.h).
+ * Packed arrays of numbers decode as array.array with arrays, else as
+ * lists. After a dedup mark (sharing), each str decoded is kept in strs,
+ * so that its back references return the same object. ascii is set by a
+ * two stage decode for a str its scan found to be all ASCII, which is
+ * then copied without checking it again.
+ */
+typedef struct ESDecodeOpts {
+  ESKeyCache *keys;
+  uint64_t viewmin;
+  bool twostage;
+  bool arrays;
+  bool sharing;
+  bool ascii;
+  PyObject *source;
+  PyObject *view;
+  ESDecodeStrs *strs;
+} ESDecodeOpts;
+
+/* Read-only memoryview of len bytes at the reader's offset */
+static PyObject*
+decode_view(ESReader* buf, ESDecodeOpts* opts, uint64_t len) {
+  if (!opts->view) {
+    PyObject *view = PyMemoryView_FromObject(opts->source);
+    if (!view) return NULL;
+    opts->view = PyObject_CallMethod(view, "toreadonly", NULL);
+    Py_DECREF(view);
+    if (!opts->view) return NULL;
+  }
+
+  PyObject *start = PyLong_FromUnsignedLongLong(buf->offset);
+  PyObject *stop = PyLong_FromUnsignedLongLong(buf->offset + len);
+  PyObject *slice = (start && stop) ? PySlice_New(start, stop, NULL) : NULL;
+  Py_XDECREF(start);
+  Py_XDECREF(stop);
+  if (!slice) return NULL;
+
+  PyObject *result = PyObject_GetItem(opts->view, slice);
+  Py_DECREF(slice);
+  return result;
+}
+
+/* An array.array of code holding a copy of len bytes of data */
+static PyObject*
+decode_arrayobject(byte code, const byte* data, uint64_t len) {
+  PyObject* array = PyObject_CallFunction((PyObject*)MyPyArray_Type, "C", code);
+  PyObject* view = PyMemoryView_FromMemory((char*)data, len, PyBUF_READ);
+  PyObject* result = (array && view ?
+                      PyObject_CallMethod(array, "frombytes", "O", view) : NULL);
+  Py_XDECREF(view);
+  if (result && ESARRAY_SWAPPED && esarray_width(code) > 1) {
+    Py_SETREF(result, PyObject_CallMethod(array, "byteswap", NULL));
+  }
+  if (!result) {
+    Py_XDECREF(array);
+    return NULL;
+  }
+  Py_DECREF(result);
+  return array;
+}
+
+/* Keep str (a new reference, returned) as decoded from the head at at */
 static inline PyObject*
-decode_object_body(ESReader* buf) {
+decode_share(ESDecodeOpts* opts, uint64_t at, PyObject* str) {
+  if (!str) return NULL;
+  ESDecodeStr* entry = Vector_PUSH(opts->strs);
+  if (!entry) {
+    Py_DECREF(str);
+    return PyErr_NoMemory();
+  }
+  Py_INCREF(str);
+  *entry = (ESDecodeStr){at, str};
+  return str;
+}
+
+/* The kept str whose head is at target, or NULL. They are kept in the
+ * order they are decoded, so by offset. */
+static inline PyObject*
+decode_shared(ESDecodeOpts* opts, uint64_t target) {
+  uint32_t lo = 0, hi = Vector_LEN(opts->strs);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    ESDecodeStr* entry = Vector_AT(opts->strs, mid);
+    if (entry->head == target) return entry->obj;
+    if (entry->head < target) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+/* Drop the kept str, at the end of a decode */
+static inline void
+decode_unshare(ESDecodeOpts* opts) {
+  for (uint32_t idx = 0; idx < Vector_LEN(opts->strs); ++idx) {
+    Py_DECREF(Vector_AT(opts->strs, idx)->obj);
+  }
+  Vector_FREE(opts->strs);
+  opts->strs = NULL;
+  opts->sharing = 0;
+}
+
+/* Where the str that a back reference at at, distance bytes after it,
+ * starts, or UINT64_MAX if no str head is there */
+static inline uint64_t
+decode_reftarget(ESReader* buf, uint64_t at, uint64_t distance) {
+  if (!distance || distance > at) return UINT64_MAX;
+  byte headbyte = buf->str[at - distance];
+  byte type = headbyte >> 4;
+  if (type == ESTYPE_TINYSTR || (type == ESTYPE_STRING && (headbyte & 0x08))) {
+    return at - distance;
+  }
+  return UINT64_MAX;
+}
 
+/* Decode the str at target, referred back to and not kept */
+static PyObject*
+decode_refstr(ESReader* buf, uint64_t target, ESDecodeOpts* opts, bool iskey) {
   eshead_t _eshead; // Allocate on stack
   eshead_t* eshead = &_eshead;
-  PyObject *obj = NULL;
 
-  byte headbyte = ESReader_readtype(buf, byte);
+  ESReader str = {buf->str, target, buf->size};
+  byte headbyte = ESReader_readtype(&str, byte);
   ESHEAD_INITDECODE(eshead, headbyte);
+  uint64_t len = ESHEAD_GETINFO(eshead);
+  if (ESHEAD_GETTYPE(eshead) == ESTYPE_STRING) {
+    const byte* bytes = ESReader_read(&str, ESHEAD_GETNUMWIDTH(eshead, 1));
+    ESHEAD_DECODELEN(eshead, bytes);
+    len = eshead->val.u64;
+  }
+
+  const byte* contents = ESReader_read(&str, len);
+  if (iskey && opts->keys) {
+    return ESKeyCache_get(opts->keys, contents, len);
+  }
+  return MyPyUnicode_FromUTF8(contents, len);
+}
+
+/* Read the rest of a packed array's head, after its head byte, into
+ * eshead (the count) and *code. Returns where its data starts, moving
+ * past it, or NULL if the input ends first or (with a DecodeError) the
+ * element code is unknown. */
+static inline const byte*
+decode_arrayhead(ESReader* buf, eshead_t* eshead, byte* code) {
+  const byte* bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+  ESHEAD_DECODELEN(eshead, bytes);
+  *code = ESReader_readtype(buf, byte);
+  int width = esarray_width(*code);
+  if (width < 0) {
+    PyErr_Format(ESCODE_DecodeError, "Unrecognized array element code: %02x", *code);
+    return NULL;
+  }
+  esread_assert(eshead->val.u64 <= esarray_maxcount(width, buf->size - buf->offset));
+  return ESReader_read(buf, esarray_datalen(width, eshead->val.u64));
+}
+
+/* Item idx of the data of a packed array of code */
+static inline PyObject*
+decode_arrayitem(byte code, const byte* data, uint64_t idx) {
+  int width = esarray_width(code);
+  assert(width >= 0);
+  switch (code) {
+  case ESARRAY_BOOL:
+    return PyBool_FromLong((data[idx >> 3] >> (idx & 7)) & 1);
+  case ESARRAY_FLOAT32: {
+    uint32_t bits = (uint32_t)esarray_getu(data + idx * 4, 4);
+    float num;
+    memcpy(&num, &bits, sizeof(num));
+    return PyFloat_FromDouble(num);
+  }
+  case ESARRAY_FLOAT64: {
+    uint64_t bits = esarray_getu(data + idx * 8, 8);
+    double num;
+    memcpy(&num, &bits, sizeof(num));
+    return PyFloat_FromDouble(num);
+  }
+  case ESARRAY_UINT8: case ESARRAY_UINT16: case ESARRAY_UINT32: case ESARRAY_UINT64:
+    return PyLong_FromUnsignedLongLong(esarray_getu(data + idx * width, width));
+  }
+  return PyLong_FromLongLong(esarray_get(data + idx * width, width));
+}
+
+/* Decode the rest of a packed array, after its head byte, into a list or
+ * with opts->arrays an array.array (bools always decode as a list) */
+static PyObject*
+decode_array(ESReader* buf, eshead_t* eshead, ESDecodeOpts* opts) {
+  byte code;
+  const byte* data = decode_arrayhead(buf, eshead, &code);
+  if (!data) return NULL;
+  uint64_t count = eshead->val.u64;
+  int width = esarray_width(code);
+  assert(width >= 0);
+
+  if (opts->arrays && width) {
+    return decode_arrayobject(code, data, esarray_datalen(width, count));
+  }
+
+  PyObject* list = PyList_New(count);
+  if (!list) return NULL;
+
+  // One loop per code, so each is specialized to its code
+#define _DECODE_ARRAYITEMS(code)                                        \
+  for (uint64_t idx = 0; idx < count; ++idx) {                          \
+    PyObject* item = decode_arrayitem(code, data, idx);                 \
+    if (!item) {                                                        \
+      Py_DECREF(list);                                                  \
+      return NULL;                                                      \
+    }                                                                   \
+    PyList_SET_ITEM(list, idx, item);                                   \
+  }
+
+  switch (code) {
+  case ESARRAY_BOOL: _DECODE_ARRAYITEMS(ESARRAY_BOOL); break;
+  case ESARRAY_FLOAT32: _DECODE_ARRAYITEMS(ESARRAY_FLOAT32); break;
+  case ESARRAY_FLOAT64: _DECODE_ARRAYITEMS(ESARRAY_FLOAT64); break;
+  case ESARRAY_INT8: _DECODE_ARRAYITEMS(ESARRAY_INT8); break;
+  case ESARRAY_INT16: _DECODE_ARRAYITEMS(ESARRAY_INT16); break;
+  case ESARRAY_INT32: _DECODE_ARRAYITEMS(ESARRAY_INT32); break;
+  case ESARRAY_INT64: _DECODE_ARRAYITEMS(ESARRAY_INT64); break;
+  default: _DECODE_ARRAYITEMS(code);
+  }
+#undef _DECODE_ARRAYITEMS
+
+  return list;
+}
+
+/* Decode a scalar, or an empty list/tuple/set/dict to be filled by
+ * decode_object with the eshead->val.u64 items that follow it. iskey is
+ * set when decoding a dict key, which may come from opts->keys. A lookup
+ * table or a dedup mark is stepped over to the value it is for. */
+ESCODE_HOT PyObject*
+decode_object_body(ESReader* buf, eshead_t* eshead, ESDecodeOpts* opts,
+                   bool iskey) {
 
   const byte* bytes;
+  byte headbyte;
+  uint64_t at;
+
+ head:
+  at = buf->offset;
+  headbyte = ESReader_readtype(buf, byte);
+  ESHEAD_INITDECODE(eshead, headbyte);
 
   switch (ESHEAD_GETTYPE(eshead)) {
 
@@ -41,10 +290,25 @@ decode_object_body(ESReader* buf) {
     bool ispos = ESHEAD_GETBIT(eshead);
     bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, ispos));
     ESHEAD_DECODEINT(eshead, bytes);
+#if PY_VERSION_HEX >= 0x030C0000
+    if (eshead->enc.width <= MyPyLong_COMPACTWIDTH) {
+      return PyLong_FromLong((long)eshead->val.i64);
+    }
+#endif //PY_VERSION_HEX >= 0x030C0000
     return (ispos ?
             PyLong_FromUnsignedLongLong(eshead->val.u64) :
             PyLong_FromLongLong(eshead->val.i64));
 
+  case ESTYPE_BIGINT: {
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    ESHEAD_DECODELEN(eshead, bytes);
+    bytes = ESReader_read(buf, eshead->val.u64);
+    return MyPyLong_FromByteArray(bytes, eshead->val.u64, 0, 1);
+  }
+
+  case ESTYPE_TINYINT:
+    return PyLong_FromLong(ESHEAD_GETINFO(eshead));
+
 #if PY_VERSION_HEX >= 0x03030000
   case ESTYPE_DEC: {
     bytes = ESReader_read(buf, 1);
@@ -76,10 +340,55 @@ decode_object_body(ESReader* buf) {
   case ESTYPE_STRING: {
     bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
     bool isunicode = ESHEAD_DECODELEN(eshead, bytes);
+    if (!isunicode && opts->viewmin && eshead->val.u64 >= opts->viewmin &&
+        eshead->val.u64 <= buf->size - buf->offset) {
+      PyObject* view = decode_view(buf, opts, eshead->val.u64);
+      buf->offset += eshead->val.u64;
+      return view;
+    }
+
     const byte* contents = ESReader_read(buf, eshead->val.u64);
-    return (isunicode ?
-            PyUnicode_DecodeUTF8((char*)contents, eshead->val.u64, "strict") :
-            PyBytes_FromStringAndSize((char*)contents, eshead->val.u64));
+    if (!isunicode) {
+      return PyBytes_FromStringAndSize((char*)contents, eshead->val.u64);
+    }
+    PyObject* str = (iskey && opts->keys ?
+                     ESKeyCache_get(opts->keys, contents, eshead->val.u64) :
+                     opts->ascii ?
+                     MyPyUnicode_FromASCII(contents, eshead->val.u64) :
+                     MyPyUnicode_FromUTF8(contents, eshead->val.u64));
+    return opts->sharing ? decode_share(opts, at, str) : str;
+  }
+
+  case ESTYPE_TINYSTR: {
+    uint64_t len = ESHEAD_GETINFO(eshead);
+    const byte* contents = ESReader_read(buf, len);
+    PyObject* str = (iskey && opts->keys ?
+                     ESKeyCache_get(opts->keys, contents, len) :
+                     opts->ascii ?
+                     MyPyUnicode_FromASCII(contents, len) :
+                     MyPyUnicode_FromUTF8(contents, len));
+    return opts->sharing ? decode_share(opts, at, str) : str;
+  }
+
+  case ESTYPE_REF: {
+    if (!ESHEAD_GETBIT(eshead)) {
+      opts->sharing = opts->strs != NULL;
+      goto head;
+    }
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    ESHEAD_DECODELEN(eshead, bytes);
+    uint64_t target = decode_reftarget(buf, at, eshead->val.u64);
+    if (target == UINT64_MAX) {
+      PyErr_Format(ESCODE_DecodeError, "back reference at offset %llu is not to a str",
+                   (unsigned long long)at);
+      return NULL;
+    }
+    PyObject* str = opts->sharing ? decode_shared(opts, target) : NULL;
+    if (str) {
+      Py_INCREF(str);
+      return str;
+    }
+    return decode_refstr(buf, target, opts, iskey);
   }
 
   case ESTYPE_LIST: {
@@ -89,37 +398,15 @@ decode_object_body(ESReader* buf) {
     /* Each element is >=1 byte, so a length above the bytes remaining is
      * corrupt: this stops a tiny blob from forcing a huge PyList_New (OOM).
      * It caps allocation at O(input); it does not vet the elements
-     * themselves, which are validated as they are decoded below. */
+     * themselves, which decode_object validates as it reads them. */
     if (eshead->val.u64 > (uint64_t)(buf->size - buf->offset)) {
       PyErr_SetString(ESCODE_DecodeError, "list length exceeds remaining input");
       return NULL;
     }
 
-    if (istuple) {
-      obj = PyTuple_New(eshead->val.u64);
-      if (obj == NULL) return NULL;
-      for (uint64_t idx = 0; idx < eshead->val.u64; ++idx) {
-        PyObject* elem = decode_object(buf);
-        if (elem == NULL) {
-          Py_DECREF(obj);
-          return NULL;
-        }
-        PyTuple_SET_ITEM(obj, idx, elem);
-      }
-    } else {
-      obj = PyList_New(eshead->val.u64);
-      if (obj == NULL) return NULL;
-      for (uint64_t idx = 0; idx < eshead->val.u64; ++idx) {
-        PyObject* elem = decode_object(buf);
-        if (elem == NULL) {
-          Py_DECREF(obj);
-          return NULL;
-        }
-        PyList_SET_ITEM(obj, idx, elem);
-      }
-    }
-
-    return obj;
+    return (istuple ?
+            PyTuple_New(eshead->val.u64) :
+            PyList_New(eshead->val.u64));
   }
 
   case ESTYPE_SET: {
@@ -134,51 +421,475 @@ decode_object_body(ESReader* buf) {
       return NULL;
     }
 
-    if (isdict) {
-      obj = _PyDict_NewPresized(eshead->val.u64);
-      if (obj == NULL) return NULL;
-      for (uint64_t idx = 0; idx < eshead->val.u64; ++idx) {
-        PyObject* key = decode_object(buf);
-        PyObject* val = decode_object(buf);
-        if (key == NULL || val == NULL || PyDict_SetItem(obj, key, val) < 0) {
-          Py_XDECREF(key);Py_XDECREF(val);Py_DECREF(obj);
-          return NULL;
-        }
-        Py_DECREF(key);Py_DECREF(val);
+    return (isdict ?
+            _PyDict_NewPresized(eshead->val.u64) :
+            PySet_New(NULL));
+  }
+
+  case ESTYPE_EXT: {
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    ESHEAD_DECODELEN(eshead, bytes);
+    if (eshead->val.u64 > ESEXT_MAXCODE) {
+      PyErr_Format(ESCODE_DecodeError, "extension code out of range: %llu",
+                   (unsigned long long)eshead->val.u64);
+      return NULL;
+    }
+
+    // A one item container: it holds the code till its value is decoded
+    PyObject* code = PyLong_FromUnsignedLongLong(eshead->val.u64);
+    eshead->val.u64 = 1;
+    return code;
+  }
+
+  case ESTYPE_ARRAY:
+    return decode_array(buf, eshead, opts);
+
+  case ESTYPE_TABLE: {
+    ESTable table;
+    --buf->offset; // estable_read reads the head byte again
+    if (!estable_read(buf, &table)) return NULL;
+    if (!table.width) {
+      PyErr_SetString(ESCODE_DecodeError, "lookup table does not fit its container");
+      return NULL;
+    }
+    goto head;
+  }
+  }}
+
+  PyErr_Format(ESCODE_DecodeError, "Unrecognized type in headbyte: %02x", headbyte);
+  return NULL;
+}
+
+/**
+ * A list/tuple/set/dict being filled: the container, its head (type and
+ * bit), how many items it holds and how many are in. key is a decoded
+ * dict key waiting for its value. Extension frames take a single item.
+ */
+typedef struct ESDecodeFrame {
+  byte headbyte;
+  PyObject *obj;
+  uint64_t len;
+  uint64_t idx;
+  PyObject *key;
+} ESDecodeFrame;
+
+VECTOR_TYPE(ESDecodeStack, ESDecodeFrame, 32);
+
+/* Add item (stolen) to the frame's container. Returns 0 on error. */
+ESCODE_HOT int
+decode_add(ESDecodeFrame* frame, PyObject* item) {
+
+  switch (ESHEAD_GETTYPE(frame)) {
+    case ESTYPE_LIST: {
+      if (ESHEAD_GETBIT(frame)) {
+        PyTuple_SET_ITEM(frame->obj, frame->idx++, item);
+      } else {
+        PyList_SET_ITEM(frame->obj, frame->idx++, item);
       }
-    } else {
-      obj = PySet_New(NULL);
-      if (obj == NULL) return NULL;
-      for (uint64_t idx = 0; idx < eshead->val.u64; ++idx) {
-        PyObject* item = decode_object(buf);
-        if (item == NULL || PySet_Add(obj, item) < 0) {
-          Py_XDECREF(item);Py_DECREF(obj);
-          return NULL;
+      return 1;
+    }
+
+    case ESTYPE_SET: {
+      int result;
+      if (ESHEAD_GETBIT(frame)) {
+        if (!frame->key) {
+          frame->key = item;
+          return 1;
         }
-        Py_DECREF(item);
+        result = MyPyDict_SetItem(frame->obj, frame->key, item);
+        Py_CLEAR(frame->key);
+      } else {
+        result = PySet_Add(frame->obj, item);
       }
+      Py_DECREF(item);
+      frame->idx++;
+      return result == 0;
+    }
+
+    case ESTYPE_EXT: {
+      PyObject* obj = esext_decode(PyLong_AsUnsignedLongLong(frame->obj), item);
+      Py_DECREF(item);
+      if (!obj) return 0;
+      Py_SETREF(frame->obj, obj);
+      frame->idx++;
+      return 1;
     }
+  }
+
+  Py_DECREF(item);
+  return 0;
+}
 
-    return obj;
+/* Push a frame to fill obj, a container of eshead->val.u64 items. On
+ * error obj is released and 0 returned. */
+ESCODE_HOT int
+decode_open(ESDecodeStack* stack, eshead_t* eshead, PyObject* obj) {
+  if (Vector_LEN(stack) >= ESCODE_maxdepth) {
+    PyErr_SetString(PyExc_RecursionError,
+                    "maximum depth exceeded while decoding an escode object");
+    Py_DECREF(obj);
+    return 0;
   }
-  }}
 
-  PyErr_Format(ESCODE_DecodeError, "Unrecognized type in headbyte: %02x", headbyte);
+  ESDecodeFrame* frame = Vector_PUSH(stack);
+  if (!frame) {
+    PyErr_NoMemory();
+    Py_DECREF(obj);
+    return 0;
+  }
+  *frame = (ESDecodeFrame){eshead->headbyte, obj, eshead->val.u64, 0, NULL};
+  return 1;
+}
+
+/* Hand *obj to its parent, closing every container it completes. Returns
+ * 1 while a container is open, 0 when *obj is the whole value, -1 on error */
+ESCODE_HOT int
+decode_close(ESDecodeStack* stack, PyObject** obj) {
+  ESDecodeFrame* frame;
+  while ((frame = Vector_TOP(stack))) {
+    if (!decode_add(frame, *obj)) return -1;
+    if (frame->idx < frame->len) return 1;
+    *obj = frame->obj;
+    Vector_POP(stack);
+  }
+  return 0;
+}
+
+/* Release the partially filled containers, after an error */
+static inline PyObject*
+decode_unwind(ESDecodeStack* stack) {
+  ESDecodeFrame* frame;
+  while ((frame = Vector_POP(stack))) {
+    Py_XDECREF(frame->key);
+    Py_DECREF(frame->obj);
+  }
+  Vector_FREE(stack);
+
+  if (!PyErr_Occurred()) {
+    PyErr_SetString(ESCODE_DecodeError, "truncated input");
+  }
   return NULL;
 }
 
-/* Bound recursion DEPTH (not width): a deeply nested (or attacker-crafted)
- * blob would otherwise overflow the C stack and segfault. This turns that
- * into a catchable RecursionError at the normal Python limit. */
+/* Whether the next value decoded is a key of the dict being filled */
+#define decode_iskey(stack)                                             \
+  ({ESDecodeFrame* _top = Vector_TOP(stack);                            \
+    (_top && !_top->key &&                                              \
+     ESHEAD_GETTYPE(_top) == ESTYPE_SET && ESHEAD_GETBIT(_top));})
+
+#define decode_isopen(eshead)                                           \
+  ((ESHEAD_GETTYPE(eshead) == ESTYPE_LIST ||                            \
+    ESHEAD_GETTYPE(eshead) == ESTYPE_SET ||                             \
+    ESHEAD_GETTYPE(eshead) == ESTYPE_EXT) && (eshead)->val.u64)
+
+/**
+ * Decode iteratively over an explicit stack of partially filled containers
+ * instead of recursing on the C stack. Depth (not width) is bounded by
+ * ESCODE_maxdepth, so a deeply nested (or attacker-crafted) blob raises
+ * RecursionError rather than overflowing the stack.
+ */
 static inline PyObject*
-decode_object(ESReader* buf) {
-  if (Py_EnterRecursiveCall(" while decoding an escode object")) {
-    return NULL;
+decode_object(ESReader* buf, ESDecodeOpts* opts) {
+
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+
+  ESDecodeStack _stack; // Allocate on stack
+  ESDecodeStack* stack = &_stack;
+  Vector_INIT(stack);
+
+  ESDecodeStrs _strs; // Allocate on stack
+  opts->strs = &_strs;
+  Vector_INIT(opts->strs);
+
+  PyObject* result = NULL;
+  while (1) {
+    PyObject* obj = decode_object_body(buf, eshead, opts, decode_iskey(stack));
+    if (!obj) break;
+
+    if (decode_isopen(eshead)) {
+      if (!decode_open(stack, eshead, obj)) break;
+      continue;
+    }
+
+    int open = decode_close(stack, &obj);
+    if (open < 0) break;
+    if (!open) {
+      Vector_FREE(stack);
+      result = obj;
+      break;
+    }
+  }
+
+  if (!result) {
+    decode_unwind(stack);
   }
-  PyObject* result = decode_object_body(buf);
-  Py_LeaveRecursiveCall();
+  decode_unshare(opts);
   return result;
 }
 
 
+/* Why decode_scan stopped */
+#define ESSCAN_OK 0
+#define ESSCAN_TRUNCATED 1
+#define ESSCAN_BADTYPE 2
+#define ESSCAN_BADUTF8 3
+#define ESSCAN_TOODEEP 4
+#define ESSCAN_NOMEM 5
+#define ESSCAN_BADTABLE 6
+#define ESSCAN_BADREF 7
+
+/**
+ * Move the reader past one head and, for scalars, their contents, without
+ * building anything or touching Python (so it runs without the GIL). *len
+ * is the head's number: a string/bigint length, a container's item count
+ * or an extension code. *items is how many values follow that belong to
+ * it: a container's items, twice that for a dict, 1 for an extension.
+ * Strings are checked to be valid UTF-8 if utf8, setting *ascii for a str
+ * that is all ASCII. A lookup table is read
+ * as part of the head of the container after it, a dedup mark as part of
+ * the value after it. Back references are checked to point at a str
+ * head. Returns the new cursor, or NULL with *status saying why.
+ */
+static inline const byte*
+decode_scan(ESReader* buf, bool utf8, uint64_t* len, uint64_t* items, bool* ascii,
+            int* status) {
+
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+  const byte* bytes;
+
+  *status = ESSCAN_TRUNCATED;
+  *len = *items = 0;
+  *ascii = 0;
+
+ head:;
+  uint64_t at = buf->offset;
+  byte headbyte = ESReader_readtype(buf, byte);
+  ESHEAD_INITDECODE(eshead, headbyte);
+
+  switch (ESHEAD_GETTYPE(eshead)) {
+
+  case ESTYPE_NONE:
+  case ESTYPE_BOOL:
+  case ESTYPE_TINYINT:
+    break;
+
+  case ESTYPE_INT:
+    ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, ESHEAD_GETBIT(eshead)));
+    break;
+
+  case ESTYPE_FLOAT:
+    ESReader_read(buf, sizeof(double));
+    break;
+
+#if PY_VERSION_HEX >= 0x03030000
+  case ESTYPE_DEC: {
+    bytes = ESReader_read(buf, 1);
+    switch ((ESHEAD_GETINFO(eshead) << 8) | *bytes) {
+      case 0x000: case 0x7FF: case 0x800: case 0xFFF: goto done;
+    }
+    ESReader_read(buf, ESHEAD_GETEXPWIDTH(eshead)-1);
+    uint8_t sign = !ESHEAD_DECODEEXP(eshead, bytes);
+    ESReader_readtill(buf, sign);
+    break;
+  }
+#endif //PY_VERSION_HEX >= 0x03030000
+
+  case ESTYPE_STRING:
+  case ESTYPE_BIGINT: {
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    bool isunicode = ESHEAD_DECODELEN(eshead, bytes);
+    *len = eshead->val.u64;
+    bytes = ESReader_read(buf, *len);
+    if (utf8 && isunicode && ESHEAD_GETTYPE(eshead) == ESTYPE_STRING) {
+      goto utf8;
+    }
+    break;
+  }
+
+  case ESTYPE_TINYSTR:
+    *len = ESHEAD_GETINFO(eshead);
+    bytes = ESReader_read(buf, *len);
+    if (utf8) {
+      goto utf8;
+    }
+    break;
+
+  case ESTYPE_REF:
+    if (!ESHEAD_GETBIT(eshead)) goto head;
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    ESHEAD_DECODELEN(eshead, bytes);
+    if (decode_reftarget(buf, at, eshead->val.u64) == UINT64_MAX) {
+      *status = ESSCAN_BADREF;
+      return NULL;
+    }
+    break;
+
+  case ESTYPE_LIST:
+  case ESTYPE_SET:
+  case ESTYPE_EXT: {
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    bool bit = ESHEAD_DECODELEN(eshead, bytes);
+    byte type = ESHEAD_GETTYPE(eshead);
+
+    if (type == ESTYPE_EXT && eshead->val.u64 > ESEXT_MAXCODE) {
+      *status = ESSCAN_BADTYPE;
+      return NULL;
+    }
+
+    // Every value takes at least a byte, so items never exceed the input
+    *len = eshead->val.u64;
+    *items = (type == ESTYPE_EXT ? 1 : *len);
+    uint64_t remaining = buf->size - buf->offset;
+    esread_assert(*items <= remaining);
+    if (type == ESTYPE_SET && bit) { // dict: a key and a value per item
+      *items *= 2;
+      esread_assert(*items <= remaining);
+    }
+    break;
+  }
+
+  case ESTYPE_ARRAY: {
+    bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+    ESHEAD_DECODELEN(eshead, bytes);
+    *len = eshead->val.u64;
+    int width = esarray_width(ESReader_readtype(buf, byte));
+    if (width < 0) {
+      *status = ESSCAN_BADTYPE;
+      return NULL;
+    }
+    esread_assert(*len <= esarray_maxcount(width, buf->size - buf->offset));
+    ESReader_read(buf, esarray_datalen(width, *len));
+    break;
+  }
+
+  case ESTYPE_TABLE: {
+    // Part of its container's head: checked to fit it, then stepped over
+    ESTable table;
+    --buf->offset; // estable_read reads the head byte again
+    if (!estable_read(buf, &table)) return NULL;
+    if (!table.width) {
+      *status = ESSCAN_BADTABLE;
+      return NULL;
+    }
+    goto head;
+  }
+
+  default:
+    *status = ESSCAN_BADTYPE;
+    return NULL;
+  }
+
+ done:
+  *status = ESSCAN_OK;
+  return ESReader_cursor(buf);
+
+ utf8:;
+  // The ASCII prefix is valid as it is
+  uint64_t prefix = esutf8_asciilen(bytes, *len);
+  *ascii = prefix == *len;
+  if (!*ascii && !esutf8_valid(bytes + prefix, *len - prefix)) {
+    *status = ESSCAN_BADUTF8;
+    return NULL;
+  }
+  goto done;
+}
+
+/* Raise the error for a decode_scan status, head being the value's offset */
+static PyObject*
+decode_scanerror(ESReader* buf, uint64_t head, int status) {
+  switch (status) {
+  case ESSCAN_BADTYPE:
+    PyErr_Format(ESCODE_DecodeError, "Unrecognized type in headbyte: %02x",
+                 buf->str[head]);
+    break;
+  case ESSCAN_BADUTF8:
+    PyErr_Format(ESCODE_DecodeError, "invalid utf-8 in string at offset %llu",
+                 (unsigned long long)head);
+    break;
+  case ESSCAN_TOODEEP:
+    PyErr_SetString(PyExc_RecursionError,
+                    "maximum depth exceeded while decoding an escode object");
+    break;
+  case ESSCAN_NOMEM:
+    PyErr_NoMemory();
+    break;
+  case ESSCAN_BADTABLE:
+    PyErr_Format(ESCODE_DecodeError, "lookup table at offset %llu does not fit "
+                 "its container", (unsigned long long)head);
+    break;
+  case ESSCAN_BADREF:
+    PyErr_Format(ESCODE_DecodeError, "back reference at offset %llu is not to a str",
+                 (unsigned long long)head);
+    break;
+  default:
+    PyErr_SetString(ESCODE_DecodeError, "truncated input");
+  }
+  return NULL;
+}
+
+/**
+ * Move the reader past one encoded value without building anything. Only
+ * heads are decoded: scalars skip their widths and lengths, and a
+ * container adds its item count to what is left to skip. Returns the new
+ * cursor, or NULL if the input is corrupt or ends first.
+ */
+static inline const byte*
+decode_skip(ESReader* buf) {
+
+  uint64_t len, items;
+  bool ascii;
+  int status;
+
+  // Every value takes at least a byte, so pending never exceeds the input
+  uint64_t pending = 1;
+
+  while (pending--) {
+    uint64_t head = buf->offset;
+    if (!decode_scan(buf, 0, &len, &items, &ascii, &status)) {
+      decode_scanerror(buf, head, status);
+      return NULL;
+    }
+    esread_assert(pending <= buf->size - buf->offset - items);
+    pending += items;
+  }
+
+  return ESReader_cursor(buf);
+}
+
+
+/**
+ * Read the lookup table at buf into table, if there is one, leaving buf at
+ * the head after it. table->width is 0 if there is none or it does not
+ * fit its container. A dedup mark before it is stepped over. NULL if the
+ * input ends first.
+ */
+static inline const byte*
+decode_table(ESReader* buf, ESTable* table) {
+  *table = (ESTable){0};
+  while (buf->offset < buf->size && (buf->str[buf->offset] & 0xF8) == ESTYPE_REF << 4) {
+    ++buf->offset;
+  }
+  if (buf->offset < buf->size && buf->str[buf->offset] >> 4 == ESTYPE_TABLE) {
+    return estable_read(buf, table);
+  }
+  return ESReader_cursor(buf);
+}
+
+/**
+ * Read the head of a container at buf into eshead, checking its count
+ * against what is left of the input. NULL if the input ends first.
+ */
+static inline const byte*
+decode_head(ESReader* buf, eshead_t* eshead) {
+  byte headbyte = ESReader_readtype(buf, byte);
+  ESHEAD_INITDECODE(eshead, headbyte);
+  const byte* bytes = ESReader_read(buf, ESHEAD_GETNUMWIDTH(eshead, 1));
+  ESHEAD_DECODELEN(eshead, bytes);
+  esread_assert(eshead->val.u64 <= buf->size - buf->offset);
+  return bytes;
+}
+
+
 #endif //__ESCODE_DECODER_H__
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * escode.Decoder: a decoder that shares dict keys across the blobs it
+ * decodes
+ *
+ */
+
+#ifndef __ESCODE_DECODEROBJECT_H__
+#define __ESCODE_DECODEROBJECT_H__
+
+#include <Python.h>
+#include "core/keycache.h"
+#include "escode.h"
+#include "decoder.h"
+
+typedef struct ESDecoderObject {
+  PyObject_HEAD
+  bool cachekeys;
+  bool releasegil;
+  bool arrays;
+  uint64_t viewmin;
+  ESKeyCache keys;
+} ESDecoderObject;
+
+static int
+ESDecoder_init(ESDecoderObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = {"cache_keys", "memoryview_threshold", "release_gil",
+                           "arrays", NULL};
+  int cachekeys = 1, releasegil = 0, arrays = 0;
+  PyObject *threshold = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pOpp:Decoder", kwlist,
+                                   &cachekeys, &threshold, &releasegil, &arrays)) {
+    return -1;
+  }
+
+  uint64_t viewmin = 0;
+  if (threshold != Py_None) {
+    viewmin = PyLong_AsUnsignedLongLong(threshold);
+    if (PyErr_Occurred()) return -1;
+    if (!viewmin) viewmin = 1;
+  }
+
+  ESKeyCache_CLEAR(&self->keys);
+  self->cachekeys = cachekeys;
+  self->releasegil = releasegil;
+  self->arrays = arrays;
+  self->viewmin = viewmin;
+  return 0;
+}
+
+static void
+ESDecoder_dealloc(ESDecoderObject *self)
+{
+  ESKeyCache_CLEAR(&self->keys);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject*
+ESDecoder_decode(ESDecoderObject *self, PyObject *object)
+{
+  ESDecodeOpts opts = {
+    .keys = self->cachekeys ? &self->keys : NULL,
+    .viewmin = self->viewmin,
+    .twostage = self->releasegil,
+    .arrays = self->arrays,
+  };
+  return ESCODE_decode_buffer(object, &opts, 0);
+}
+
+static PyObject*
+ESDecoder_clear(ESDecoderObject *self, PyObject *noargs)
+{
+  ESKeyCache_CLEAR(&self->keys);
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef ESDecoder_methods[] = {
+  {"decode", (PyCFunction)ESDecoder_decode, METH_O,
+   PyDoc_STR("decode(buffer) -> like escode.decode, with dict keys shared\n"
+             "across calls: a key seen before is the same str object.")},
+  {"clear", (PyCFunction)ESDecoder_clear, METH_NOARGS,
+   PyDoc_STR("clear() -> drop the cached keys.")},
+  {NULL, NULL}  // sentinel
+};
+
+static PyTypeObject ESDecoder_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.Decoder",
+  .tp_basicsize = sizeof(ESDecoderObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("Decoder(cache_keys=True, memoryview_threshold=None, release_gil=False,\n"
+                      "arrays=False) -> reusable decoder for runs of records with recurring\n"
+                      "dict keys. Bytes values of memoryview_threshold or more bytes are\n"
+                      "returned as read-only memoryviews of the input instead of copies. With\n"
+                      "release_gil, each blob is first validated without holding the GIL,\n"
+                      "letting other threads run, then decoded from the offsets that scan\n"
+                      "recorded. With arrays, packed arrays of numbers decode as array.array\n"
+                      "instead of lists."),
+  .tp_methods = ESDecoder_methods,
+  .tp_init = (initproc)ESDecoder_init,
+  .tp_dealloc = (destructor)ESDecoder_dealloc,
+  .tp_new = PyType_GenericNew,
+};
+
+
+#endif //__ESCODE_DECODEROBJECT_H__
@@ -14,7 +14,11 @@
 #include "core/strbuf.h"
 #include "core/constants.h"
 #include "core/eshead.h"
+#include "core/stack.h"
+#include "core/table.h"
+#include "core/packed.h"
 #include "escode.h"
+#include "registry.h"
 
 #define enc_assert(cond) if(!(cond)) { return 0; }
 #define enc_assert_err(cond, str)                   \
@@ -24,19 +28,327 @@
   }
 
 
-/* Forward declaration so the recursive descent below routes back through
- * encode_object(), which guards each level against unbounded recursion. */
-static inline int encode_object(PyObject *object, ESWriter* buf);
+/**
+ * Settings for one encode. Lists, tuples and dicts of tablemin or more
+ * items (if set) are written with a lookup table, see core/table.h.
+ * Lists of packmin or more numbers or bools (if set) are written as
+ * packed arrays, see core/packed.h. With compact, ints of 0..ESTINY_MAX
+ * and the lengths of str of up to ESTINY_MAX bytes go in the head byte.
+ * With dedup, a str written before is written again as a back reference
+ * to it when that is shorter (not with tablemin: the tables inserted
+ * into the output would throw off the distances).
+ */
+typedef struct ESEncodeOpts {
+  uint64_t tablemin;
+  uint64_t packmin;
+  bool compact;
+  bool dedup;
+} ESEncodeOpts;
+
+/* The write macros return early when the writer runs out of room, so the
+ * writes are kept in helpers that let callers release what they hold. */
 
 static inline int
-encode_object_body(PyObject *object, ESWriter* buf) {
+encode_head(eshead_t* eshead, ESWriter* buf, bool index) {
+  // Write the head byte
+  if (!index || eshead->ops & OP_ESINDEXHEAD) {
+    ESWriter_write_raw(buf, &(eshead->headbyte), sizeof(byte));
+  }
+
+  // Write the head number if any
+  if (eshead->ops & OP_ESHASNUM) {
+    if (!index || eshead->ops & OP_ESINDEXNUM) {
+      byte *nbytes = eshead->enc.num.bytes + eshead->enc.off;
+      ESWriter_write_raw(buf, nbytes, eshead->enc.width);
+    }
+  }
+  return 1;
+}
+
+static inline int
+encode_contents(const byte* contents, uint64_t len, ESWriter* buf, bool index) {
+  ESWriter_write(buf, contents, len);
+  if (index) {
+    ESWriter_write_raw(buf, ESINDEX_SEP, ESINDEX_SEPLEN);
+  }
+  return 1;
+}
+
+/* Ints beyond int64/uint64 are written as their big-endian two's complement
+ * bytes in one bulk conversion. Index encodings (whose head was written as
+ * the widest INT) first add a length that keeps them memcmp ordered. */
+static inline int
+encode_bigint(PyObject* object, ESWriter* buf, bool pos, bool index) {
+  uint64_t len = MyPyLong_SIGNEDSIZE(object);
+
+  if (index) {
+    eshead_t _lenhead; // Allocate on stack
+    eshead_t* lenhead = &_lenhead;
+    ESHEAD_INITENCODE(lenhead);
+    lenhead->val.u64 = len;
+    ESHEAD_ENCODELEN(lenhead, 0, 1);
+
+    // Longer means larger magnitude, so flip both for negatives
+    lenhead->headbyte = FLIPIF(ESINDEX_BIGMARK | (lenhead->enc.width - 1), !pos);
+    lenhead->enc.num.b64 = FLIPIF(lenhead->enc.num.b64, !pos);
+    ESWriter_write_raw(buf, &(lenhead->headbyte), sizeof(byte));
+    ESWriter_write_raw(buf, lenhead->enc.num.bytes + lenhead->enc.off,
+                       lenhead->enc.width);
+  }
+
+  byte* cursor = ESWriter_alloc(buf, len);
+  if (!ESWriter_sizing(buf)) {
+    enc_assert(MyPyLong_AsByteArray(object, cursor, len, 0, 1) == 0);
+  }
+  return 1;
+}
+
+/* An int to pack, or 0 with *overflow set if it does not fit int64 */
+static inline int64_t
+encode_packint(PyObject* item, int* overflow) {
+#if PY_VERSION_HEX >= 0x030C0000
+  if (MyPyLong_IsCompact(item)) {
+    *overflow = 0;
+    return MyPyLong_CompactValue(item);
+  }
+#endif //PY_VERSION_HEX >= 0x030C0000
+  return PyLong_AsLongLongAndOverflow(item, overflow);
+}
+
+/* Write an ESTYPE_ARRAY head for count items of code, and its code */
+static inline int
+encode_arrayhead(eshead_t* eshead, ESWriter* buf, uint64_t count, byte code) {
+  eshead->val.u64 = count;
+  ESHEAD_ENCODELEN(eshead, ESTYPE_ARRAY, 0);
+  enc_assert(encode_head(eshead, buf, 0));
+  byte* out = ESWriter_alloc(buf, sizeof(byte));
+  if (!ESWriter_sizing(buf)) {
+    *out = code;
+  }
+  return 1;
+}
+
+/**
+ * Write a list as a packed array if its items are all floats, all bools
+ * or all ints that fit int64, the latter as the narrowest width holding
+ * them, unless a few wide ints would make that bigger than a head for
+ * each. Returns 1 if written, 0 on error, -1 to write it as a list.
+ */
+static inline int
+encode_packlist(PyObject* list, ESWriter* buf, eshead_t* eshead) {
+  Py_ssize_t len = PyList_GET_SIZE(list);
+  PyObject** items = PySequence_Fast_ITEMS(list);
+  PyTypeObject* type = Py_TYPE(items[0]);
+  int64_t min = 0, max = 0;
+  uint64_t unpacked = 0;
+  int overflow;
+  byte code;
+
+  for (Py_ssize_t idx = 0; idx < len; ++idx) {
+    if (Py_TYPE(items[idx]) != type) return -1;
+  }
+
+  if (type == &PyFloat_Type) {
+    code = ESARRAY_FLOAT64;
+  } else if (type == &PyBool_Type) {
+    code = ESARRAY_BOOL;
+  } else if (type == &PyLong_Type) {
+    for (Py_ssize_t idx = 0; idx < len; ++idx) {
+      int64_t num = encode_packint(items[idx], &overflow);
+      if (overflow) return -1;
+      if (num < min) min = num;
+      if (num > max) max = num;
+      unpacked += 1 + _NUMWIDTH((uint64_t)num, num >= 0);
+    }
+    code = esarray_intcode(min, max);
+    if (esarray_datalen(esarray_width(code), len) > unpacked) return -1;
+  } else {
+    return -1;
+  }
+
+  enc_assert(encode_arrayhead(eshead, buf, len, code));
+  int width = esarray_width(code);
+  assert(width >= 0);
+  uint64_t datalen = esarray_datalen(width, len);
+  byte* out = ESWriter_alloc(buf, datalen);
+  if (ESWriter_sizing(buf)) {
+    return 1;
+  }
+
+  switch (code) {
+  case ESARRAY_FLOAT64:
+    for (Py_ssize_t idx = 0; idx < len; ++idx) {
+      double num = PyFloat_AS_DOUBLE(items[idx]);
+      uint64_t bits;
+      memcpy(&bits, &num, sizeof(bits));
+      esarray_put(out + idx * sizeof(double), bits, sizeof(double));
+    }
+    break;
+
+  case ESARRAY_BOOL:
+    memset(out, 0, datalen);
+    for (Py_ssize_t idx = 0; idx < len; ++idx) {
+      out[idx >> 3] |= (items[idx] == Py_True) << (idx & 7);
+    }
+    break;
+
+  default:
+    for (Py_ssize_t idx = 0; idx < len; ++idx) {
+      esarray_put(out + idx * width, encode_packint(items[idx], &overflow), width);
+    }
+  }
+  return 1;
+}
+
+/* Element code of a buffer of (struct module) format and itemsize, 0 if
+ * its items are not single native numbers */
+static inline byte
+encode_arraycode(const char* format, Py_ssize_t itemsize) {
+  if (!format) return ESARRAY_UINT8;
+  if (format[0] == '@') ++format;
+  if (!format[0] || format[1]) return 0;
+
+  switch (format[0]) {
+  case 'b': case 'h': case 'i': case 'l': case 'q': case 'n':
+    switch (itemsize) {
+    case 1: return ESARRAY_INT8;
+    case 2: return ESARRAY_INT16;
+    case 4: return ESARRAY_INT32;
+    case 8: return ESARRAY_INT64;
+    }
+    break;
+  case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N':
+    switch (itemsize) {
+    case 1: return ESARRAY_UINT8;
+    case 2: return ESARRAY_UINT16;
+    case 4: return ESARRAY_UINT32;
+    case 8: return ESARRAY_UINT64;
+    }
+    break;
+  case 'f':
+    if (itemsize == 4) return ESARRAY_FLOAT32;
+    break;
+  case 'd':
+    if (itemsize == 8) return ESARRAY_FLOAT64;
+    break;
+  }
+  return 0;
+}
+
+/* Write the items of a buffer view as the data of a packed array */
+static inline int
+encode_arraydata(ESWriter* buf, Py_buffer* view, byte code) {
+  int width = esarray_width(code);
+  assert(width >= 0);
+  if (!ESARRAY_SWAPPED || width == 1) {
+    ESWriter_write_raw(buf, (byte*)view->buf, (uint64_t)view->len);
+    return 1;
+  }
+
+  byte* out = ESWriter_alloc(buf, (uint64_t)view->len);
+  if (!ESWriter_sizing(buf)) {
+    for (Py_ssize_t pos = 0; pos < view->len; pos += width) {
+      uint64_t num = 0;
+      memcpy((byte*)&num + sizeof(num) - width, (byte*)view->buf + pos, width);
+      esarray_put(out + pos, num, width);
+    }
+  }
+  return 1;
+}
+
+/**
+ * Write an object with a C contiguous buffer straight from its memory:
+ * array.array, and others whose items are numbers (a memoryview cast to
+ * 'd', say), as a packed array, and the rest, like bytearray or a
+ * memoryview of bytes, as bytes. Only the bytes are index encodable.
+ */
+static inline int
+encode_buffer(PyObject* object, ESWriter* buf, eshead_t* eshead, bool index) {
+  Py_buffer view;
+  enc_assert(PyObject_GetBuffer(object, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0);
+
+  bool isarray = Py_TYPE(object) == MyPyArray_Type;
+  byte code = encode_arraycode(view.format, view.itemsize);
+  if (code == ESARRAY_UINT8 && !isarray) {
+    code = 0;
+  }
+
+  int ok = 0;
+  if (isarray && !code) {
+    PyErr_Format(ESCODE_UnsupportedError, "array.array of typecode '%s'", view.format);
+  } else if (code && index) {
+    PyErr_SetString(ESCODE_EncodeError, "array type is not index encodable");
+  } else if (code) {
+    ok = (encode_arrayhead(eshead, buf, view.len / view.itemsize, code) &&
+          encode_arraydata(buf, &view, code));
+  } else {
+    eshead->val.u64 = view.len;
+    ESHEAD_ENCODELEN(eshead, ESTYPE_STRING, 0);
+    ok = (encode_head(eshead, buf, index) &&
+          encode_contents((byte*)view.buf, view.len, buf, index));
+  }
+  PyBuffer_Release(&view);
+  return ok;
+}
+
+/**
+ * For dedup encodings: write str, of len UTF-8 bytes, as a back reference
+ * if it was written before (strs maps each str written to the offset of
+ * its head) and that is shorter. Returns 1 if it was, 0 if str is to be
+ * written out (at the head offset now recorded for it), -1 on error.
+ */
+static inline int
+encode_strref(PyObject* str, uint64_t len, ESWriter* buf, eshead_t* eshead,
+              PyObject* strs, bool compact) {
+  PyObject* head = PyDict_GetItemWithError(strs, str);
+  if (head) {
+    eshead->val.u64 = buf->offset - PyLong_AsUnsignedLongLong(head);
+    ESHEAD_ENCODELEN(eshead, ESTYPE_REF, 1);
+    uint64_t strlen = len + (compact && len <= ESTINY_MAX ? 0 : _NUMWIDTH(len, 1));
+    if (eshead->enc.width < strlen) {
+      return encode_head(eshead, buf, 0) ? 1 : -1;
+    }
+  } else if (PyErr_Occurred()) {
+    return -1;
+  }
+
+  // Refer later copies to this one, the nearest
+  head = PyLong_FromUnsignedLongLong(buf->offset);
+  int result = head ? PyDict_SetItem(strs, str, head) : -1;
+  Py_XDECREF(head);
+  return result;
+}
+
+/* Move a small int or short str's head number into its info bits, as
+ * ESTYPE_TINYINT or ESTYPE_TINYSTR, for compact encodings */
+static inline void
+encode_tiny(eshead_t* eshead) {
+  if (eshead->val.u64 > ESTINY_MAX || !ESHEAD_GETBIT(eshead)) return;
+
+  switch (ESHEAD_GETTYPE(eshead)) {
+  case ESTYPE_INT:
+    ESHEAD_ENCODETINY(eshead, ESTYPE_TINYINT, eshead->val.u64);
+    break;
+  case ESTYPE_STRING:
+    ESHEAD_ENCODETINY(eshead, ESTYPE_TINYSTR, eshead->val.u64);
+    break;
+  }
+}
+
+/* Write object's head and, for scalars, its contents. The items of a
+ * list/set are left to encode_object, which walks them from eshead, as is
+ * the value an extension type is encoded as, returned in *value. strs is
+ * the str written so far by a dedup encoding, see encode_strref. */
+static inline int
+encode_object_body(PyObject *object, ESWriter* buf, eshead_t* eshead,
+                   PyObject **value, const ESEncodeOpts* opts, PyObject* strs) {
 
-  eshead_t _eshead; // Allocate on stack
-  eshead_t* eshead = &_eshead;
   ESHEAD_INITENCODE(eshead);
 
   bool index = (buf)->ops & OP_STRBUFINDEX;
   PyObject* repr = NULL;
+  const byte* contents = NULL;
+  bool bigint = 0;
 
   if (object == Py_None) {
     ESHEAD_ENCODENONE(eshead, ESTYPE_NONE);
@@ -44,76 +356,153 @@ encode_object_body(PyObject *object, ESWriter* buf) {
     ESHEAD_ENCODEBOOL(eshead, ESTYPE_BOOL, 1);
   } else if (object == Py_False) {
     ESHEAD_ENCODEBOOL(eshead, ESTYPE_BOOL, 0);
+  } else {
+
+    ESTypeSlot* slot = estypemap_find(Py_TYPE(object));
+    switch (slot->kind) {
 
-  } else if (PyInt_CheckExact(object) || PyLong_CheckExact(object)) {
-    int32_t ofl;
-    eshead->val.i64 = PyLong_AsLongLongAndOverflow(object, &ofl);
-    if (ofl > 0) { eshead->val.u64 = PyLong_AsUnsignedLongLong(object); }
-    enc_assert(!PyErr_Occurred()); enc_assert_err(ofl>=0, "Negative number out of bounds");
-    bool pos = (ofl || eshead->val.i64 >= 0);
-    ESHEAD_ENCODEINT(eshead, ESTYPE_INT, pos);
+    case ESKIND_INT: {
+#if PY_VERSION_HEX >= 0x030C0000
+      if (MyPyLong_IsCompact(object)) {
+        eshead->val.i64 = MyPyLong_CompactValue(object);
+        ESHEAD_ENCODEINT(eshead, ESTYPE_INT, eshead->val.i64 >= 0);
+        break;
+      }
+#endif //PY_VERSION_HEX >= 0x030C0000
+
+      int32_t ofl;
+      eshead->val.i64 = PyLong_AsLongLongAndOverflow(object, &ofl);
+      enc_assert(!PyErr_Occurred());
+      bool pos = (ofl > 0 || (!ofl && eshead->val.i64 >= 0));
+      bigint = ofl < 0 || (ofl > 0 && _PyLong_NumBits(object) > 64);
+
+      if (!bigint) {
+        if (ofl > 0) { eshead->val.u64 = PyLong_AsUnsignedLongLong(object); }
+        ESHEAD_ENCODEINT(eshead, ESTYPE_INT, pos);
+      } else if (index) {
+        eshead->val.u64 = pos ? UINT64_MAX : 0;
+        ESHEAD_ENCODEINT(eshead, ESTYPE_INT, pos);
+      } else {
+        eshead->val.u64 = MyPyLong_SIGNEDSIZE(object);
+        ESHEAD_ENCODELEN(eshead, ESTYPE_BIGINT, pos);
+      }
+      break;
+    }
 
 #if PY_VERSION_HEX >= 0x03030000
-  } else if (MyPyDec_CheckExact(object)) {
-    mpd_t* mpd = MyPyDec_Get(object);
-    if (MPD_ISSPECIAL(mpd) || MPD_ISZERO(mpd)) {
-      ESHEAD_ENCODEEXPSP(eshead, ESTYPE_DEC, MPD_ISPOS(mpd), MPD_ISINF(mpd));
-    } else {
-      eshead->val.i64 = MPD_EXP(mpd);
-      ESHEAD_ENCODEEXP(eshead, ESTYPE_DEC, MPD_ISPOS(mpd));
+    case ESKIND_DEC: {
+      mpd_t* mpd = MyPyDec_Get(object);
+      if (MPD_ISSPECIAL(mpd) || MPD_ISZERO(mpd)) {
+        ESHEAD_ENCODEEXPSP(eshead, ESTYPE_DEC, MPD_ISPOS(mpd), MPD_ISINF(mpd));
+      } else {
+        eshead->val.i64 = MPD_EXP(mpd);
+        ESHEAD_ENCODEEXP(eshead, ESTYPE_DEC, MPD_ISPOS(mpd));
+      }
+      break;
     }
 #endif //PY_VERSION_HEX >= 0x03030000
-  } else if (PyFloat_CheckExact(object)) {
-    eshead->val.flt = PyFloat_AS_DOUBLE(object);
-    ESHEAD_ENCODEFLOAT(eshead, ESTYPE_FLOAT);
 
-  } else if (PyBytes_CheckExact(object)) {
-    eshead->val.u64 = PyBytes_GET_SIZE(object);
-    ESHEAD_ENCODELEN(eshead, ESTYPE_STRING, 0);
+    case ESKIND_FLOAT:
+      eshead->val.flt = PyFloat_AS_DOUBLE(object);
+      ESHEAD_ENCODEFLOAT(eshead, ESTYPE_FLOAT);
+      break;
 
-  } else if (PyUnicode_CheckExact(object)) {
-    repr = PyUnicode_AsUTF8String(object);
-    enc_assert_err(repr, "Error converting Unicode to UTF8");
-    eshead->val.u64 = PyBytes_GET_SIZE(repr);
-    ESHEAD_ENCODELEN(eshead, ESTYPE_STRING, 1);
+    case ESKIND_BYTES:
+      eshead->val.u64 = PyBytes_GET_SIZE(object);
+      ESHEAD_ENCODELEN(eshead, ESTYPE_STRING, 0);
+      break;
 
-  } else if(PyList_CheckExact(object)) {
-    eshead->val.u64 = PyList_GET_SIZE(object);
-    ESHEAD_ENCODELEN(eshead, ESTYPE_LIST, 0);
+    case ESKIND_UNICODE: {
+      // Use the UTF-8 from the str itself if it has any, else transcode it
+      // straight into the buffer below. Only lone surrogates (an error) and
+      // index escaping of transcoded strings need a temporary repr.
+      Py_ssize_t len = MyPyUnicode_UTF8Size(object);
+      if (len >= 0) {
+        contents = MyPyUnicode_UTF8(object);
+      }
+      if (len < 0 || (index && !contents)) {
+        repr = PyUnicode_AsUTF8String(object);
+        enc_assert_err(repr, "Error converting Unicode to UTF8");
+        len = PyBytes_GET_SIZE(repr);
+      }
+      if (strs && len > 1) {
+        int ref = encode_strref(object, len, buf, eshead, strs, opts->compact);
+        if (ref) {
+          Py_XDECREF(repr);
+          return ref > 0;
+        }
+        ESHEAD_INITENCODE(eshead);
+      }
+      eshead->val.u64 = len;
+      ESHEAD_ENCODELEN(eshead, ESTYPE_STRING, 1);
+      break;
+    }
 
-  } else if (PyTuple_CheckExact(object)) {
-    eshead->val.u64 = PyTuple_GET_SIZE(object);
-    ESHEAD_ENCODELEN(eshead, ESTYPE_LIST, 1);
+    case ESKIND_LIST:
+      if (opts->packmin && (uint64_t)PyList_GET_SIZE(object) >= opts->packmin && !index) {
+        int packed = encode_packlist(object, buf, eshead);
+        if (packed >= 0) return packed;
+      }
+      eshead->val.u64 = PyList_GET_SIZE(object);
+      ESHEAD_ENCODELEN(eshead, ESTYPE_LIST, 0);
+      break;
 
-  } else if (PyAnySet_CheckExact(object)) {
-    enc_assert_err(!index, "set type is not index encodable")
-    eshead->val.u64 = PySet_GET_SIZE(object);
-    ESHEAD_ENCODELEN(eshead, ESTYPE_SET, 0);
+    case ESKIND_TUPLE:
+      eshead->val.u64 = PyTuple_GET_SIZE(object);
+      ESHEAD_ENCODELEN(eshead, ESTYPE_LIST, 1);
+      break;
 
-  } else if (PyDict_CheckExact(object)) {
-    enc_assert_err(!index, "dict type is not index encodable")
-    eshead->val.u64 = PyDict_GET_SIZE(object);
-    ESHEAD_ENCODELEN(eshead, ESTYPE_SET, 1);
+    case ESKIND_SET:
+      enc_assert_err(!index, "set type is not index encodable")
+      eshead->val.u64 = PySet_GET_SIZE(object);
+      ESHEAD_ENCODELEN(eshead, ESTYPE_SET, 0);
+      break;
 
-  } else {
-    PyErr_SetString(ESCODE_UnsupportedError, Py_TYPE(object)->tp_name);
-    return 0;
-  }
+    case ESKIND_DICT:
+      enc_assert_err(!index, "dict type is not index encodable")
+      eshead->val.u64 = PyDict_GET_SIZE(object);
+      ESHEAD_ENCODELEN(eshead, ESTYPE_SET, 1);
+      break;
 
+    case ESKIND_ARRAY:
+    case ESKIND_BUFFER:
+      return encode_buffer(object, buf, eshead, index);
 
-  // Write the head byte
-  if (!index || eshead->ops & OP_ESINDEXHEAD) {
-    ESWriter_write_raw(buf, &(eshead->headbyte), sizeof(byte));
-  }
+    case ESKIND_EXT:
+      enc_assert_err(!index, "extension types are not index encodable")
+      eshead->val.u64 = slot->code;
+      ESHEAD_ENCODELEN(eshead, ESTYPE_EXT, 0);
+      *value = esext_encode(slot->code, object);
+      enc_assert(*value);
+      break;
 
-  // Write the head number if any
-  if (eshead->ops & OP_ESHASNUM) {
-    if (!index || eshead->ops & OP_ESINDEXNUM) {
-      byte *nbytes = eshead->enc.num.bytes + eshead->enc.off;
-      ESWriter_write_raw(buf, nbytes, eshead->enc.width);
+    default:
+      if (PyObject_CheckBuffer(object)) {
+        return encode_buffer(object, buf, eshead, index);
+      }
+      PyErr_SetString(ESCODE_UnsupportedError, Py_TYPE(object)->tp_name);
+      return 0;
     }
   }
 
+  if (opts->compact && !index && !bigint) {
+    encode_tiny(eshead);
+  }
+
+
+  if (repr) {
+    int ok = (encode_head(eshead, buf, index) &&
+              encode_contents((byte*)PyBytes_AS_STRING(repr),
+                              eshead->val.u64, buf, index));
+    Py_DECREF(repr);
+    return ok;
+  }
+
+  enc_assert(encode_head(eshead, buf, index));
+
+  if (bigint) {
+    return encode_bigint(object, buf, ESHEAD_GETBIT(eshead), index);
+  }
 
   // Continuation
   switch(ESHEAD_GETTYPE(eshead)) {
@@ -124,74 +513,323 @@ encode_object_body(PyObject *object, ESWriter* buf) {
       if (!MPD_ISSPECIAL(mpd) && !MPD_ISZERO(mpd)) {
         mpd_ssize_t digits = mpd->digits - mpd_ctz(mpd);
         mpd_ssize_t len =  (digits + 1) >> 1;
-        mpd_write_base100(mpd, digits, ESWriter_alloc(buf, len));
+        byte* cursor = ESWriter_alloc(buf, len);
+        if (!ESWriter_sizing(buf)) {
+          mpd_write_base100(mpd, digits, cursor);
+        }
       }
       break;
     }
 #endif //PY_VERSION_HEX >= 0x03030000
 
-    case ESTYPE_STRING: {
-      if (ESHEAD_GETBIT(eshead)) {
-        ESWriter_write(buf, (byte*)PyBytes_AS_STRING(repr), eshead->val.u64);
-        Py_DECREF(repr);
+    case ESTYPE_STRING:
+    case ESTYPE_TINYSTR: {
+      if (contents) {
+        enc_assert(encode_contents(contents, eshead->val.u64, buf, index));
+      } else if (PyUnicode_Check(object)) {
+        byte* cursor = ESWriter_alloc(buf, eshead->val.u64);
+        if (!ESWriter_sizing(buf)) {
+          MyPyUnicode_WriteUTF8(object, cursor);
+        }
       } else {
-        ESWriter_write(buf, (byte*)PyBytes_AS_STRING(object), eshead->val.u64);
-      }
-      if (index) {
-        ESWriter_write_raw(buf, (byte*)"\x00\x00", 2);
+        enc_assert(encode_contents((byte*)PyBytes_AS_STRING(object),
+                                   eshead->val.u64, buf, index));
       }
       break;
     }
 
+  }
+
+  return 1;
+}
+
+/**
+ * A list/set being encoded: the container, its head (type and bit), its
+ * length as written and where its iteration is at. value is a dict value
+ * to encode after its key, held until the item after it is asked for.
+ * An extension frame holds the one value its object was encoded as.
+ * start and items are where the container's head and first item were
+ * written. A container getting a lookup table has table set, and the
+ * offsets of its items from items are kept from mark on in the encode's
+ * ESTableOffsets.
+ *
+ * Extension hooks run Python code that may mutate what is being encoded,
+ * so frames own references to what they hold and check lengths at the end.
+ */
+typedef struct ESEncodeFrame {
+  byte headbyte;
+  PyObject *object;
+  Py_ssize_t len;
+  Py_ssize_t pos;
+  PyObject *value;
+  PyObject *held;
+  uint64_t start;
+  uint64_t items;
+  uint32_t mark;
+  bool table;
+} ESEncodeFrame;
+
+VECTOR_TYPE(ESEncodeStack, ESEncodeFrame, 32);
+VECTOR_TYPE(ESTableOffsets, uint64_t, 64);
+
+/* Next item of the frame's container to encode, or NULL when exhausted */
+static inline PyObject*
+encode_next(ESEncodeFrame* frame) {
+  PyObject *item = NULL;
+  Py_CLEAR(frame->held);
+
+  switch (ESHEAD_GETTYPE(frame)) {
     case ESTYPE_LIST: {
-      if (ESHEAD_GETBIT(eshead)) {
-        for (uint64_t idx = 0; idx < eshead->val.u64; ++idx) {
-          enc_assert(encode_object(PyTuple_GET_ITEM(object, idx), buf));
+      if (ESHEAD_GETBIT(frame)) {
+        if (frame->pos < PyTuple_GET_SIZE(frame->object)) {
+          item = PyTuple_GET_ITEM(frame->object, frame->pos++);
         }
       } else {
-        for (uint64_t idx = 0; idx < eshead->val.u64; ++idx) {
-          enc_assert(encode_object(PyList_GET_ITEM(object, idx), buf));
+        if (frame->pos < PyList_GET_SIZE(frame->object)) {
+          item = PyList_GET_ITEM(frame->object, frame->pos++);
         }
       }
       break;
     }
 
     case ESTYPE_SET: {
-      Py_ssize_t pos = 0;
-      PyObject* item = NULL;
-      if (ESHEAD_GETBIT(eshead)) {
-        PyObject *key;
-        while (PyDict_Next(object, &pos, &key, &item)) {
-          enc_assert(encode_object(key, buf));
-          enc_assert(encode_object(item, buf));
+      if (ESHEAD_GETBIT(frame)) {
+        if (frame->value) {
+          item = frame->held = frame->value;
+          frame->value = NULL;
+        } else if (PyDict_Next(frame->object, &frame->pos, &item, &frame->value)) {
+          Py_INCREF(frame->value);
         }
       } else {
         Py_hash_t hash;
-        while (_PySet_NextEntry(object, &pos, &item, &hash)) {
-          enc_assert(encode_object(item, buf));
-        }
+        _PySet_NextEntry(frame->object, &frame->pos, &item, &hash);
       }
       break;
     }
+
+    case ESTYPE_EXT: {
+      if (!frame->pos++) {
+        item = frame->object;
+      }
+      break;
+    }
+  }
+
+  return item;
+}
+
+/* Whether the frame's container still has the length that was written */
+static inline int
+encode_checklen(ESEncodeFrame* frame) {
+  if (ESHEAD_GETTYPE(frame) == ESTYPE_EXT ||
+      PyObject_Length(frame->object) == frame->len) {
+    return 1;
   }
 
+  PyErr_Format(PyExc_RuntimeError, "%s changed size during encoding",
+               Py_TYPE(frame->object)->tp_name);
+  return 0;
+}
+
+static inline void
+encode_popframe(ESEncodeStack* stack) {
+  ESEncodeFrame* frame = Vector_POP(stack);
+  Py_DECREF(frame->object);
+  Py_XDECREF(frame->value);
+  Py_XDECREF(frame->held);
+}
+
+typedef struct ESTableKey {
+  uint32_t hash;
+  uint64_t offset;
+} ESTableKey;
+
+static int
+encode_tablekeycmp(const void* left, const void* right) {
+  const ESTableKey* l = left;
+  const ESTableKey* r = right;
+  if (l->hash != r->hash) return l->hash < r->hash ? -1 : 1;
+  return l->offset < r->offset ? -1 : l->offset > r->offset;
+}
+
+/**
+ * Insert the lookup table of the container the frame has just finished in
+ * front of its head, moving the container up to make room. items holds
+ * the offsets of its items, or of its keys and values for a dict. A
+ * sizing writer only counts the table's length.
+ */
+static inline int
+encode_table(ESWriter* buf, ESEncodeFrame* frame, const uint64_t* items) {
+  bool keyed = ESHEAD_GETTYPE(frame) == ESTYPE_SET;
+  uint64_t count = frame->len;
+  byte width = estable_width(items[(count - 1) << keyed]);
+  uint64_t entrysize = width + ESTABLE_HASHWIDTH * keyed;
+
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+  ESHEAD_INITENCODE(eshead);
+  eshead->val.u64 = 1 + count * entrysize;
+  ESHEAD_ENCODELEN(eshead, ESTYPE_TABLE, keyed);
+  uint64_t headlen = sizeof(byte) + eshead->enc.width;
+  uint64_t tablelen = headlen + eshead->val.u64;
+
+  ESWriter_prepare(buf, tablelen);
+  if (!ESWriter_sizing(buf)) {
+    byte* start = buf->_str + frame->start;
+    memmove(start + tablelen, start, buf->offset - frame->start);
+    start[0] = eshead->headbyte;
+    memcpy(start + 1, eshead->enc.num.bytes + eshead->enc.off, eshead->enc.width);
+    start[headlen] = width;
+
+    byte* entries = start + headlen + 1;
+    if (!keyed) {
+      for (uint64_t idx = 0; idx < count; ++idx) {
+        estable_writenum(entries + idx * entrysize, items[idx], width);
+      }
+    } else {
+      ESTableKey* keys = PyMem_Malloc(sizeof(ESTableKey) * count);
+      if (!keys) {
+        PyErr_NoMemory();
+        return 0;
+      }
+      const byte* first = buf->_str + frame->items + tablelen;
+      for (uint64_t idx = 0; idx < count; ++idx) {
+        uint64_t key = items[2 * idx];
+        keys[idx] = (ESTableKey){estable_hash(first + key, items[2 * idx + 1] - key), key};
+      }
+      qsort(keys, count, sizeof(ESTableKey), encode_tablekeycmp);
+      for (uint64_t idx = 0; idx < count; ++idx) {
+        byte* entry = entries + idx * entrysize;
+        estable_writenum(entry, keys[idx].hash, ESTABLE_HASHWIDTH);
+        estable_writenum(entry + ESTABLE_HASHWIDTH, keys[idx].offset, width);
+      }
+      PyMem_Free(keys);
+    }
+  }
+  buf->offset += tablelen;
   return 1;
 }
 
-/* Bound recursion DEPTH (not width): deep nesting or a self-referential
- * container would otherwise overflow the C stack and segfault. This turns
- * that into a catchable RecursionError at the normal Python limit. */
 static inline int
-encode_object(PyObject *object, ESWriter* buf) {
-  if (Py_EnterRecursiveCall(" while encoding an escode object")) {
-    return 0;
+encode_dedupmark(ESWriter* buf) {
+  byte* mark = ESWriter_alloc(buf, 1);
+  if (!ESWriter_sizing(buf)) {
+    *mark = ESTYPE_REF << 4;
   }
-  int result = encode_object_body(object, buf);
-  Py_LeaveRecursiveCall();
-  return result;
+  return 1;
 }
 
+/**
+ * Encode iteratively over an explicit stack of container frames instead of
+ * recursing on the C stack. Depth (not width) is bounded by
+ * ESCODE_maxdepth, independent of the interpreter's recursion limit, so
+ * deep nesting or a self-referential container raises RecursionError.
+ */
+static inline int
+encode_object(PyObject *object, ESWriter* buf, const ESEncodeOpts* opts) {
+
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+
+  ESEncodeStack _stack; // Allocate on stack
+  ESEncodeStack* stack = &_stack;
+  Vector_INIT(stack);
+
+  ESTableOffsets _offsets; // Allocate on stack
+  ESTableOffsets* offsets = &_offsets;
+  Vector_INIT(offsets);
+
+  bool index = buf->ops & OP_STRBUFINDEX;
+
+  // A dedup encoding starts with a mark, so decoders keep its str
+  int ok = 1;
+  PyObject* strs = NULL;
+  if (opts->dedup && !index) {
+    strs = PyDict_New();
+    ok = strs && encode_dedupmark(buf);
+  }
+
+  while (ok) {
+
+    if (object) {
+      // Dict keys never get tables, so they encode as they are looked up
+      ESEncodeFrame* parent = Vector_TOP(stack);
+      bool iskey = parent && parent->value && ESHEAD_GETTYPE(parent) == ESTYPE_SET;
+      if (parent && parent->table) {
+        uint64_t* at = Vector_PUSH(offsets);
+        if (!at) {
+          PyErr_NoMemory();
+          ok = 0;
+          break;
+        }
+        *at = buf->offset - parent->items;
+      }
+
+      uint64_t start = buf->offset;
+      PyObject *value = NULL;
+      ok = encode_object_body(object, buf, eshead, &value, opts, strs);
+      byte type = ESHEAD_GETTYPE(eshead);
+
+      if (value) {
+        object = value; // encoded next, in place of the extension object
+      } else if (ok && (type == ESTYPE_LIST || type == ESTYPE_SET) &&
+                 eshead->val.u64) {
+        Py_INCREF(object);
+      } else {
+        object = NULL;
+      }
+
+      if (object && ok) {
+        if (Vector_LEN(stack) >= ESCODE_maxdepth) {
+          PyErr_SetString(PyExc_RecursionError,
+                          "maximum depth exceeded while encoding an escode object");
+          ok = 0;
+        } else {
+          ESEncodeFrame* frame = Vector_PUSH(stack);
+          if (frame) {
+            bool table = (opts->tablemin && eshead->val.u64 >= opts->tablemin &&
+                          !index && !iskey &&
+                          (type == ESTYPE_LIST ||
+                           (type == ESTYPE_SET && ESHEAD_GETBIT(eshead))));
+            *frame = (ESEncodeFrame){eshead->headbyte, object,
+                                     eshead->val.u64, 0, NULL, NULL,
+                                     start, buf->offset, Vector_LEN(offsets), table};
+            object = NULL;
+          } else {
+            PyErr_NoMemory();
+            ok = 0;
+          }
+        }
+      }
+
+      if (!ok) {
+        Py_XDECREF(object);
+        break;
+      }
+    }
+
+    ESEncodeFrame* frame = Vector_TOP(stack);
+    if (!frame) break;
 
+    object = encode_next(frame);
+    if (!object) {
+      ok = encode_checklen(frame);
+      if (ok && frame->table) {
+        ok = encode_table(buf, frame, Vector_AT(offsets, frame->mark));
+        offsets->offset = frame->mark;
+      }
+      encode_popframe(stack);
+    }
+  }
+
+  while (Vector_LEN(stack)) {
+    encode_popframe(stack);
+  }
+  Vector_FREE(stack);
+  Vector_FREE(offsets);
+  Py_XDECREF(strs);
+  return ok;
+}
 
 
 #endif //__ESCODE_ENCODER_H__
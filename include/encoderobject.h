@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * escode.Encoder: an encoder that sizes its output buffer from what it
+ * has encoded recently
+ *
+ */
+
+#ifndef __ESCODE_ENCODEROBJECT_H__
+#define __ESCODE_ENCODEROBJECT_H__
+
+#include <Python.h>
+#include <structmember.h>
+#include "escode.h"
+
+typedef struct ESEncoderObject {
+  PyObject_HEAD
+  uint64_t sizehint;
+  ESEncodeOpts opts;
+} ESEncoderObject;
+
+static int
+ESEncoder_init(ESEncoderObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = {"size_hint", "table_min", "pack_min", "compact", "dedup",
+                           NULL};
+  unsigned long long sizehint = ESCODE_SIZEHINT, tablemin = 0, packmin = 0;
+  int compact = 0, dedup = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|KKKpp:Encoder", kwlist,
+                                   &sizehint, &tablemin, &packmin, &compact,
+                                   &dedup)) {
+    return -1;
+  }
+  self->sizehint = sizehint < ESWRITER_MAXSIZE ? sizehint : ESWRITER_MAXSIZE;
+  if (dedup && tablemin) {
+    PyErr_SetString(PyExc_ValueError, "dedup can not be combined with table_min");
+    return -1;
+  }
+  self->opts = (ESEncodeOpts){.tablemin = tablemin, .packmin = packmin,
+                              .compact = compact, .dedup = dedup};
+  return 0;
+}
+
+static PyObject*
+ESEncoder_encode(ESEncoderObject *self, PyObject *object)
+{
+  return ESCODE_encode_bytes(object, &self->sizehint, &self->opts);
+}
+
+static PyMethodDef ESEncoder_methods[] = {
+  {"encode", (PyCFunction)ESEncoder_encode, METH_O,
+   PyDoc_STR("encode(object) -> string. Like escode.encode, starting from\n"
+             "a buffer sized after this encoder's recent outputs.")},
+  {NULL, NULL}  // sentinel
+};
+
+static PyMemberDef ESEncoder_members[] = {
+  {"size_hint", T_ULONGLONG, offsetof(ESEncoderObject, sizehint), READONLY,
+   PyDoc_STR("initial buffer size for the next encode")},
+  {"table_min", T_ULONGLONG, offsetof(ESEncoderObject, opts.tablemin), READONLY,
+   PyDoc_STR("fewest items for a list, tuple or dict to get a lookup table, 0 for none")},
+  {"pack_min", T_ULONGLONG, offsetof(ESEncoderObject, opts.packmin), READONLY,
+   PyDoc_STR("fewest items for a list of numbers or bools to be packed, 0 for none")},
+  {"compact", T_BOOL, offsetof(ESEncoderObject, opts.compact), READONLY,
+   PyDoc_STR("whether small ints and short str keep their value or length in the head byte")},
+  {"dedup", T_BOOL, offsetof(ESEncoderObject, opts.dedup), READONLY,
+   PyDoc_STR("whether repeated str are written as back references")},
+  {NULL}  // sentinel
+};
+
+static PyTypeObject ESEncoder_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.Encoder",
+  .tp_basicsize = sizeof(ESEncoderObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("Encoder(size_hint=256, table_min=0, pack_min=0, compact=False,\n"
+                      "dedup=False) -> reusable encoder for runs of similar objects.\n"
+                      "Not thread safe: use one per thread.\n"
+                      "With table_min, lists, tuples and dicts (other than dict keys) of\n"
+                      "at least that many items are written with a lookup table, which\n"
+                      "escode.get, escode.Path and LazyList use to reach an item without\n"
+                      "skipping those before it. Any decoder reads them as usual.\n"
+                      "With pack_min, lists of at least that many items that are all floats,\n"
+                      "all bools or all ints that fit 64 bits are packed into one block of\n"
+                      "raw numbers (or bits), as array.array objects always are. They decode\n"
+                      "as lists, or as array.array with Decoder(arrays=True).\n"
+                      "With compact, ints of 0..15 and str of up to 15 UTF-8 bytes (most\n"
+                      "dict keys) are written without a length or number byte. Any decoder\n"
+                      "reads them; index encodings never use them.\n"
+                      "With dedup, a str written earlier in the same encode (a dict key of\n"
+                      "every record, an enum-like value) is written again as a short\n"
+                      "reference back to it, and decodes to the same str object. It can\n"
+                      "not be combined with table_min."),
+  .tp_methods = ESEncoder_methods,
+  .tp_members = ESEncoder_members,
+  .tp_init = (initproc)ESEncoder_init,
+  .tp_new = PyType_GenericNew,
+};
+
+
+#endif //__ESCODE_ENCODEROBJECT_H__
@@ -8,20 +8,75 @@
 #define __ESCODE_H__
 
 #include <Python.h>
+#include "core/constants.h"
 
 static PyObject *ESCODE_Error;
 static PyObject *ESCODE_EncodeError;
 static PyObject *ESCODE_DecodeError;
 static PyObject *ESCODE_UnsupportedError;
 
+static uint32_t ESCODE_maxdepth = ESCODE_MAXDEPTH;
+
 static PyObject*
 ESCODE_encode(PyObject *self, PyObject *object);
 
+struct ESEncodeOpts;
+static PyObject*
+ESCODE_encode_bytes(PyObject *object, uint64_t *sizehint, struct ESEncodeOpts *opts);
+
+static PyObject*
+ESCODE_encode_into(PyObject *self, PyObject *args);
+
+static PyObject*
+ESCODE_encoded_size(PyObject *self, PyObject *object);
+
 static PyObject*
 ESCODE_decode(PyObject *self, PyObject *object);
 
+/* A view of bytes or any contiguous buffer, released with
+ * ESCODE_releasebuffer (bytes are read without taking a view) */
+static inline int
+ESCODE_getbuffer(PyObject *object, Py_buffer *view);
+
+#define ESCODE_releasebuffer(view)              \
+  if ((view)->obj) { PyBuffer_Release(view); }
+
+struct ESDecodeOpts;
+static PyObject*
+ESCODE_decode_buffer(PyObject *object, struct ESDecodeOpts *opts, bool callkeys);
+
 static PyObject*
 ESCODE_encode_index(PyObject *self, PyObject *args);
 
+static PyObject*
+ESCODE_set_max_depth(PyObject *self, PyObject *args);
+
+static PyObject*
+ESCODE_get_max_depth(PyObject *self, PyObject *noargs);
+
+static PyObject*
+ESCODE_register(PyObject *self, PyObject *args);
+
+static PyObject*
+ESCODE_unregister(PyObject *self, PyObject *type);
+
+/**
+ * C API, for extension modules to register their types with C hooks:
+ *
+ *   ESCODE_CAPI *api = PyCapsule_Import(ESCODE_CAPI_NAME, 0);
+ *   api->RegisterType(&MyType, code, my_encode, my_decode);
+ *
+ * Hooks take the object (encode) or decoded value (decode) and return a
+ * new reference, or NULL with an exception set.
+ */
+#define ESCODE_CAPI_NAME "escode._C_API"
+
+typedef struct ESCODE_CAPI {
+  int (*RegisterType)(PyTypeObject *type, int code,
+                      PyObject* (*encode)(PyObject*),
+                      PyObject* (*decode)(PyObject*));
+  int (*UnregisterType)(PyTypeObject *type);
+} ESCODE_CAPI;
+
 
 #endif //__ESCODE_H__
@@ -0,0 +1,603 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Lazy decoding: LazyDict and LazyList proxies that decode their items
+ * from the input only when they are accessed
+ *
+ */
+
+#ifndef __ESCODE_LAZY_H__
+#define __ESCODE_LAZY_H__
+
+#include <Python.h>
+#include "core/strbuf.h"
+#include "core/eshead.h"
+#include "decoder.h"
+#include "escode.h"
+#include "path.h"
+
+/* The input of a lazy decode, shared by every proxy made from it */
+typedef struct ESLazySource {
+  PyObject_HEAD
+  Py_buffer view;
+} ESLazySource;
+
+static void
+ESLazySource_dealloc(ESLazySource *self)
+{
+  PyBuffer_Release(&self->view);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyTypeObject ESLazySource_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode._LazySource",
+  .tp_basicsize = sizeof(ESLazySource),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc = (destructor)ESLazySource_dealloc,
+};
+
+static ESLazySource*
+eslazy_source(PyObject *object)
+{
+  if (!PyObject_CheckBuffer(object)) {
+    PyErr_SetString(ESCODE_DecodeError, "Can not decode non-buffer");
+    return NULL;
+  }
+
+  ESLazySource *source = PyObject_New(ESLazySource, &ESLazySource_Type);
+  if (!source) return NULL;
+  if (PyObject_GetBuffer(object, &source->view, PyBUF_SIMPLE) < 0) {
+    source->view.obj = NULL;
+    Py_DECREF(source);
+    return NULL;
+  }
+  return source;
+}
+
+#define ESLazySource_reader(source, at)                                 \
+  ((ESReader){.str = (byte*)(source)->view.buf,                         \
+              .offset = (at),                                           \
+              .size = (uint64_t)(source)->view.len})
+
+
+/**
+ * A dict or list in the input: where its head and first item are, and
+ * its item count. On first access, offsets is filled with where each
+ * value starts (and, for a dict, index maps each key to its position) in
+ * one pass that skips over the values, or for a list with a lookup table
+ * from the table. values caches what was decoded. A dict is only indexed
+ * to iterate it or look up a key that is not a str: a str key is found
+ * by comparing encodings (looked up in the dict's table if it has one),
+ * and its value kept in hits until it is.
+ */
+typedef struct ESLazyObject {
+  PyObject_HEAD
+  ESLazySource *source;
+  uint64_t head;
+  uint64_t start;
+  Py_ssize_t len;
+  ESTable table;
+  uint64_t *offsets;
+  PyObject **values;
+  PyObject *index;
+  PyObject *hits;
+} ESLazyObject;
+
+static PyTypeObject ESLazyDict_Type;
+static PyTypeObject ESLazyList_Type;
+
+#define ESLazyDict_Check(op) (Py_TYPE(op) == &ESLazyDict_Type)
+#define ESLazyList_Check(op) (Py_TYPE(op) == &ESLazyList_Type)
+
+static void
+ESLazy_dealloc(ESLazyObject *self)
+{
+  if (self->values) {
+    for (Py_ssize_t idx = 0; idx < self->len; ++idx) {
+      Py_XDECREF(self->values[idx]);
+    }
+    PyMem_Free(self->values);
+  }
+  PyMem_Free(self->offsets);
+  Py_XDECREF(self->index);
+  Py_XDECREF(self->hits);
+  Py_XDECREF(self->source);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static inline PyObject*
+eslazy_truncated(void)
+{
+  if (!PyErr_Occurred()) {
+    PyErr_SetString(ESCODE_DecodeError, "truncated input");
+  }
+  return NULL;
+}
+
+/**
+ * The value at offset: a LazyDict or LazyList for a dict or list, else
+ * the decoded object (tuples, sets and extension types decode whole).
+ */
+static PyObject*
+eslazy_decodeat(ESLazySource* source, uint64_t offset)
+{
+  ESReader buf = ESLazySource_reader(source, offset);
+  ESTable table;
+  if (!decode_table(&buf, &table) || buf.offset >= buf.size) {
+    return eslazy_truncated();
+  }
+
+  byte headbyte = buf.str[buf.offset];
+  byte type = headbyte >> 4;
+  bool bit = (headbyte >> 3) & 1;
+  PyTypeObject *lazytype = (type == ESTYPE_SET && bit ? &ESLazyDict_Type :
+                            type == ESTYPE_LIST && !bit ? &ESLazyList_Type :
+                            NULL);
+
+  if (!lazytype) {
+    ESDecodeOpts opts = {0};
+    return decode_object(&buf, &opts);
+  }
+
+  eshead_t _eshead; // Allocate on stack
+  if (!decode_head(&buf, &_eshead)) {
+    return eslazy_truncated();
+  }
+
+  ESLazyObject *self = PyObject_New(ESLazyObject, lazytype);
+  if (!self) return NULL;
+  Py_INCREF(source);
+  self->source = source;
+  self->head = offset;
+  self->start = buf.offset;
+  self->len = (Py_ssize_t)_eshead.val.u64;
+  self->table = table;
+  self->offsets = NULL;
+  self->values = NULL;
+  self->index = NULL;
+  self->hits = NULL;
+  return (PyObject*)self;
+}
+
+/* Find where each value starts, and for a dict index its keys */
+static int
+eslazy_scan(ESLazyObject *self)
+{
+  if (self->offsets) return 1;
+
+  bool isdict = ESLazyDict_Check(self);
+  uint64_t *offsets = PyMem_Malloc(sizeof(uint64_t) * (self->len ? self->len : 1));
+  PyObject **values = PyMem_Calloc(self->len ? self->len : 1, sizeof(PyObject*));
+  PyObject *index = isdict ? PyDict_New() : NULL;
+  if (!offsets || !values || (isdict && !index)) {
+    PyErr_NoMemory();
+    goto error;
+  }
+
+  ESReader buf = ESLazySource_reader(self->source, self->start);
+  ESDecodeOpts opts = {0};
+
+  for (Py_ssize_t idx = 0; idx < self->len; ++idx) {
+    if (!isdict && self->table.width) {
+      offsets[idx] = self->start + estable_offset(&self->table, idx);
+      if (offsets[idx] < self->start || offsets[idx] >= buf.size) {
+        eslazy_truncated();
+        goto error;
+      }
+      continue;
+    }
+
+    if (isdict) {
+      PyObject *key = decode_object(&buf, &opts);
+      if (!key) goto error;
+      PyObject *hit = self->hits ? PyDict_GetItemWithError(self->hits, key) : NULL;
+      Py_XINCREF(hit);
+      values[idx] = hit;
+      PyObject *pos = (hit || !PyErr_Occurred()) ? PyLong_FromSsize_t(idx) : NULL;
+      int result = pos ? PyDict_SetItem(index, key, pos) : -1;
+      Py_DECREF(key);
+      Py_XDECREF(pos);
+      if (result < 0) goto error;
+    }
+
+    offsets[idx] = buf.offset;
+    if (!decode_skip(&buf)) {
+      eslazy_truncated();
+      goto error;
+    }
+  }
+
+  self->offsets = offsets;
+  self->values = values;
+  self->index = index;
+  Py_CLEAR(self->hits);
+  return 1;
+
+ error:
+  if (values) {
+    for (Py_ssize_t idx = 0; idx < self->len; ++idx) {
+      Py_XDECREF(values[idx]);
+    }
+  }
+  PyMem_Free(offsets);
+  PyMem_Free(values);
+  Py_XDECREF(index);
+  return 0;
+}
+
+/* The value at position idx, decoded on first access */
+static PyObject*
+eslazy_value(ESLazyObject *self, Py_ssize_t idx)
+{
+  if (!self->values[idx]) {
+    self->values[idx] = eslazy_decodeat(self->source, self->offsets[idx]);
+    if (!self->values[idx]) return NULL;
+  }
+  Py_INCREF(self->values[idx]);
+  return self->values[idx];
+}
+
+static Py_ssize_t
+ESLazy_length(ESLazyObject *self)
+{
+  return self->len;
+}
+
+/* Decode the whole container into plain objects */
+static PyObject*
+ESLazy_materialize(ESLazyObject *self, PyObject *noargs)
+{
+  ESReader buf = ESLazySource_reader(self->source, self->head);
+  ESDecodeOpts opts = {0};
+  return decode_object(&buf, &opts);
+}
+
+/* Compare as the plain objects */
+static PyObject*
+ESLazy_richcompare(PyObject *self, PyObject *other, int op)
+{
+  if (op != Py_EQ && op != Py_NE) {
+    Py_RETURN_NOTIMPLEMENTED;
+  }
+
+  PyObject *left = ESLazy_materialize((ESLazyObject*)self, NULL);
+  if (!left) return NULL;
+
+  PyObject *right = other;
+  if (ESLazyDict_Check(other) || ESLazyList_Check(other)) {
+    right = ESLazy_materialize((ESLazyObject*)other, NULL);
+    if (!right) {
+      Py_DECREF(left);
+      return NULL;
+    }
+  } else {
+    Py_INCREF(right);
+  }
+
+  PyObject *result = PyObject_RichCompare(left, right, op);
+  Py_DECREF(left);
+  Py_DECREF(right);
+  return result;
+}
+
+static PyObject*
+ESLazy_repr(ESLazyObject *self)
+{
+  return PyUnicode_FromFormat("<%s of %zd items>", Py_TYPE(self)->tp_name, self->len);
+}
+
+
+/*************************************************************************
+ * LazyDict
+ *************************************************************************/
+
+/**
+ * Find a str key among the encoded keys without decoding them, with the
+ * lookup table if there is one, setting *offset to where its value
+ * starts. Returns 1 when found, 0 when missing, -1 on error. A str the
+ * encoder rejects is never a key.
+ */
+static int
+eslazydict_find(ESLazyObject *self, PyObject *key, uint64_t *offset)
+{
+  uint64_t sizehint = 16;
+  ESEncodeOpts compact = {.compact = 1};
+  PyObject *ekey = ESCODE_encode_bytes(key, &sizehint, NULL);
+  PyObject *ckey = ekey ? ESCODE_encode_bytes(key, &sizehint, &compact) : NULL;
+  if (!ckey) {
+    Py_XDECREF(ekey);
+    if (!PyErr_ExceptionMatches(ESCODE_EncodeError)) return -1;
+    PyErr_Clear();
+    return 0;
+  }
+
+  ESReader buf = ESLazySource_reader(self->source, self->start);
+  int found = (self->table.width ?
+               espath_tablekey(&buf, &self->table, ekey, ckey) :
+               espath_scankey(&buf, self->len, ekey, ckey));
+  Py_DECREF(ekey);
+  Py_DECREF(ckey);
+  *offset = buf.offset;
+  return found;
+}
+
+/* The value for key, or NULL (without an error if it is missing) */
+static PyObject*
+ESLazyDict_lookup(ESLazyObject *self, PyObject *key)
+{
+  if (!self->offsets && PyUnicode_CheckExact(key)) {
+    PyObject *value = self->hits ? PyDict_GetItemWithError(self->hits, key) : NULL;
+    if (value || PyErr_Occurred()) {
+      Py_XINCREF(value);
+      return value;
+    }
+
+    uint64_t offset;
+    if (eslazydict_find(self, key, &offset) <= 0) return NULL;
+    value = eslazy_decodeat(self->source, offset);
+    if (!value) return NULL;
+    if ((!self->hits && !(self->hits = PyDict_New())) ||
+        PyDict_SetItem(self->hits, key, value) < 0) {
+      Py_DECREF(value);
+      return NULL;
+    }
+    return value;
+  }
+
+  if (!eslazy_scan(self)) return NULL;
+  PyObject *pos = PyDict_GetItemWithError(self->index, key);
+  if (!pos) return NULL;
+  return eslazy_value(self, PyLong_AsSsize_t(pos));
+}
+
+static PyObject*
+ESLazyDict_subscript(ESLazyObject *self, PyObject *key)
+{
+  PyObject *value = ESLazyDict_lookup(self, key);
+  if (!value && !PyErr_Occurred()) {
+    PyErr_SetObject(PyExc_KeyError, key);
+  }
+  return value;
+}
+
+static int
+ESLazyDict_contains(ESLazyObject *self, PyObject *key)
+{
+  if (!self->offsets && PyUnicode_CheckExact(key)) {
+    uint64_t offset;
+    return eslazydict_find(self, key, &offset);
+  }
+  if (!eslazy_scan(self)) return -1;
+  return PyDict_Contains(self->index, key);
+}
+
+static PyObject*
+ESLazyDict_iter(ESLazyObject *self)
+{
+  if (!eslazy_scan(self)) return NULL;
+  return PyObject_GetIter(self->index);
+}
+
+static PyObject*
+ESLazyDict_get(ESLazyObject *self, PyObject *args)
+{
+  PyObject *key, *dflt = Py_None;
+  if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &dflt)) {
+    return NULL;
+  }
+  PyObject *value = ESLazyDict_lookup(self, key);
+  if (!value && !PyErr_Occurred()) {
+    Py_INCREF(dflt);
+    return dflt;
+  }
+  return value;
+}
+
+static PyObject*
+ESLazyDict_keys(ESLazyObject *self, PyObject *noargs)
+{
+  if (!eslazy_scan(self)) return NULL;
+  return PyDict_Keys(self->index);
+}
+
+/* values() or items(), in the order of the input */
+static PyObject*
+eslazydict_list(ESLazyObject *self, bool items)
+{
+  if (!eslazy_scan(self)) return NULL;
+
+  PyObject *result = PyList_New(PyDict_GET_SIZE(self->index));
+  if (!result) return NULL;
+
+  Py_ssize_t pos = 0, idx = 0;
+  PyObject *key, *at;
+  while (PyDict_Next(self->index, &pos, &key, &at)) {
+    PyObject *value = eslazy_value(self, PyLong_AsSsize_t(at));
+    if (value && items) {
+      PyObject *pair = PyTuple_Pack(2, key, value);
+      Py_DECREF(value);
+      value = pair;
+    }
+    if (!value) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, idx++, value);
+  }
+  return result;
+}
+
+static PyObject*
+ESLazyDict_values(ESLazyObject *self, PyObject *noargs)
+{
+  return eslazydict_list(self, 0);
+}
+
+static PyObject*
+ESLazyDict_items(ESLazyObject *self, PyObject *noargs)
+{
+  return eslazydict_list(self, 1);
+}
+
+static PyMappingMethods ESLazyDict_as_mapping = {
+  .mp_length = (lenfunc)ESLazy_length,
+  .mp_subscript = (binaryfunc)ESLazyDict_subscript,
+};
+
+static PySequenceMethods ESLazyDict_as_sequence = {
+  .sq_contains = (objobjproc)ESLazyDict_contains,
+};
+
+static PyMethodDef ESLazyDict_methods[] = {
+  {"get", (PyCFunction)ESLazyDict_get, METH_VARARGS,
+   PyDoc_STR("get(key, default=None) -> the value for key, decoded on first access.")},
+  {"keys", (PyCFunction)ESLazyDict_keys, METH_NOARGS,
+   PyDoc_STR("keys() -> list of the keys.")},
+  {"values", (PyCFunction)ESLazyDict_values, METH_NOARGS,
+   PyDoc_STR("values() -> list of the values, decoding them all.")},
+  {"items", (PyCFunction)ESLazyDict_items, METH_NOARGS,
+   PyDoc_STR("items() -> list of (key, value) pairs, decoding all values.")},
+  {"materialize", (PyCFunction)ESLazy_materialize, METH_NOARGS,
+   PyDoc_STR("materialize() -> the whole dict, decoded into plain objects.")},
+  {NULL, NULL}  // sentinel
+};
+
+static PyTypeObject ESLazyDict_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.LazyDict",
+  .tp_basicsize = sizeof(ESLazyObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("Read-only mapping over an encoded dict, from escode.loads_lazy.\n"
+                      "Values are decoded when first accessed, nested dicts and lists\n"
+                      "as further lazy proxies."),
+  .tp_dealloc = (destructor)ESLazy_dealloc,
+  .tp_repr = (reprfunc)ESLazy_repr,
+  .tp_as_mapping = &ESLazyDict_as_mapping,
+  .tp_as_sequence = &ESLazyDict_as_sequence,
+  .tp_richcompare = ESLazy_richcompare,
+  .tp_hash = PyObject_HashNotImplemented,
+  .tp_iter = (getiterfunc)ESLazyDict_iter,
+  .tp_methods = ESLazyDict_methods,
+};
+
+
+/*************************************************************************
+ * LazyList
+ *************************************************************************/
+
+static PyObject*
+ESLazyList_item(ESLazyObject *self, Py_ssize_t idx)
+{
+  if (idx < 0 || idx >= self->len) {
+    PyErr_SetString(PyExc_IndexError, "LazyList index out of range");
+    return NULL;
+  }
+  if (!eslazy_scan(self)) return NULL;
+  return eslazy_value(self, idx);
+}
+
+static PyObject*
+ESLazyList_subscript(ESLazyObject *self, PyObject *item)
+{
+  if (PyIndex_Check(item)) {
+    Py_ssize_t idx = PyNumber_AsSsize_t(item, PyExc_IndexError);
+    if (idx == -1 && PyErr_Occurred()) return NULL;
+    if (idx < 0) idx += self->len;
+    return ESLazyList_item(self, idx);
+  }
+
+  if (!PySlice_Check(item)) {
+    PyErr_Format(PyExc_TypeError, "LazyList indices must be integers or slices, not %s",
+                 Py_TYPE(item)->tp_name);
+    return NULL;
+  }
+
+  Py_ssize_t start, stop, step;
+  if (PySlice_Unpack(item, &start, &stop, &step) < 0) return NULL;
+  Py_ssize_t count = PySlice_AdjustIndices(self->len, &start, &stop, step);
+
+  PyObject *result = PyList_New(count);
+  if (!result) return NULL;
+  for (Py_ssize_t idx = 0, at = start; idx < count; ++idx, at += step) {
+    PyObject *value = ESLazyList_item(self, at);
+    if (!value) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, idx, value);
+  }
+  return result;
+}
+
+static PySequenceMethods ESLazyList_as_sequence = {
+  .sq_length = (lenfunc)ESLazy_length,
+  .sq_item = (ssizeargfunc)ESLazyList_item,
+};
+
+static PyMappingMethods ESLazyList_as_mapping = {
+  .mp_length = (lenfunc)ESLazy_length,
+  .mp_subscript = (binaryfunc)ESLazyList_subscript,
+};
+
+static PyMethodDef ESLazyList_methods[] = {
+  {"materialize", (PyCFunction)ESLazy_materialize, METH_NOARGS,
+   PyDoc_STR("materialize() -> the whole list, decoded into plain objects.")},
+  {NULL, NULL}  // sentinel
+};
+
+static PyTypeObject ESLazyList_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.LazyList",
+  .tp_basicsize = sizeof(ESLazyObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("Read-only sequence over an encoded list, from escode.loads_lazy.\n"
+                      "Items are decoded when first accessed, nested dicts and lists\n"
+                      "as further lazy proxies."),
+  .tp_dealloc = (destructor)ESLazy_dealloc,
+  .tp_repr = (reprfunc)ESLazy_repr,
+  .tp_as_sequence = &ESLazyList_as_sequence,
+  .tp_as_mapping = &ESLazyList_as_mapping,
+  .tp_richcompare = ESLazy_richcompare,
+  .tp_hash = PyObject_HashNotImplemented,
+  .tp_methods = ESLazyList_methods,
+};
+
+
+/* Ready the types, and register the proxies as a Mapping and a Sequence */
+static int
+eslazy_init(PyObject *module)
+{
+  if (PyType_Ready(&ESLazySource_Type) < 0 ||
+      PyType_Ready(&ESLazyDict_Type) < 0 ||
+      PyType_Ready(&ESLazyList_Type) < 0) {
+    return -1;
+  }
+
+  Py_INCREF(&ESLazyDict_Type);
+  PyModule_AddObject(module, "LazyDict", (PyObject*)&ESLazyDict_Type);
+  Py_INCREF(&ESLazyList_Type);
+  PyModule_AddObject(module, "LazyList", (PyObject*)&ESLazyList_Type);
+
+  PyObject *abc = PyImport_ImportModule("collections.abc");
+  if (!abc) return -1;
+
+  int result = 0;
+  const char *names[] = {"Mapping", "Sequence"};
+  PyTypeObject *types[] = {&ESLazyDict_Type, &ESLazyList_Type};
+  for (int idx = 0; idx < 2 && !result; ++idx) {
+    PyObject *base = PyObject_GetAttrString(abc, names[idx]);
+    PyObject *registered = base ?
+      PyObject_CallMethod(base, "register", "O", (PyObject*)types[idx]) : NULL;
+    result = registered ? 0 : -1;
+    Py_XDECREF(registered);
+    Py_XDECREF(base);
+  }
+
+  Py_DECREF(abc);
+  return result;
+}
+
+
+#endif //__ESCODE_LAZY_H__
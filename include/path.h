@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * escode.Path: a compiled path into an encoded value, walked without
+ * decoding what it passes over
+ *
+ */
+
+#ifndef __ESCODE_PATH_H__
+#define __ESCODE_PATH_H__
+
+#include <Python.h>
+#include <string.h>
+#include <structmember.h>
+#include "core/strbuf.h"
+#include "core/eshead.h"
+#include "escode.h"
+#include "decoder.h"
+
+/**
+ * A path is a tuple of steps, each a dict key or a list/tuple index.
+ * Dict keys are matched by their encoding, so keys holds each step
+ * encoded once up front and lookups are a memcmp per entry. Small int
+ * and short str keys have a second, compact encoding (see
+ * ESEncodeOpts), held in ckeys.
+ */
+typedef struct ESPathObject {
+  PyObject_HEAD
+  PyObject *steps;
+  PyObject *keys;
+  PyObject *ckeys;
+} ESPathObject;
+
+static PyTypeObject ESPath_Type;
+
+#define ESPath_Check(op) (Py_TYPE(op) == &ESPath_Type)
+
+static inline PyObject*
+espath_error(PyObject* spec, Py_ssize_t at)
+{
+  PyErr_Format(PyExc_ValueError, "invalid path %R at position %zd", spec, at);
+  return NULL;
+}
+
+/**
+ * Steps of a path string: names separated by '.', each followed by any
+ * number of [index] subscripts, e.g. "a.b[3][-1]". Names are str keys and
+ * subscripts int keys or indices.
+ */
+static PyObject*
+espath_parse(PyObject* spec)
+{
+  Py_ssize_t len;
+  const char* str = PyUnicode_AsUTF8AndSize(spec, &len);
+  if (!str) return NULL;
+
+  PyObject* steps = PyList_New(0);
+  if (!steps || !len) return steps;
+
+  Py_ssize_t pos = 0;
+  bool name = (str[0] != '[');
+  while (1) {
+    PyObject* step;
+    if (name) {
+      Py_ssize_t start = pos;
+      while (pos < len && str[pos] != '.' && str[pos] != '[') ++pos;
+      if (pos == start) goto error;
+      step = PyUnicode_DecodeUTF8(str + start, pos - start, NULL);
+    } else {
+      // [-]digits]
+      Py_ssize_t start = ++pos;
+      if (pos < len && str[pos] == '-') ++pos;
+      while (pos < len && str[pos] >= '0' && str[pos] <= '9') ++pos;
+      if (pos == start || str[pos - 1] == '-' || pos - start > 19 ||
+          pos >= len || str[pos] != ']') {
+        goto error;
+      }
+      step = PyLong_FromLongLong(strtoll(str + start, NULL, 10));
+      ++pos;
+    }
+
+    if (!step || PyList_Append(steps, step) < 0) {
+      Py_XDECREF(step);
+      Py_DECREF(steps);
+      return NULL;
+    }
+    Py_DECREF(step);
+
+    if (pos == len) break;
+    name = (str[pos] == '.');
+    if (name && ++pos == len) goto error;
+  }
+  return steps;
+
+ error:
+  Py_DECREF(steps);
+  return espath_error(spec, pos);
+}
+
+/* Path for spec: a Path, a path string, or a sequence of steps */
+static ESPathObject*
+espath_compile(PyObject* spec)
+{
+  if (ESPath_Check(spec)) {
+    Py_INCREF(spec);
+    return (ESPathObject*)spec;
+  }
+
+  PyObject* list = PyUnicode_Check(spec) ? espath_parse(spec) :
+    (PyList_Check(spec) || PyTuple_Check(spec)) ? PySequence_List(spec) : NULL;
+  if (!list) {
+    if (!PyErr_Occurred()) {
+      PyErr_Format(PyExc_TypeError, "path must be a str, list, tuple or Path, not %s",
+                   Py_TYPE(spec)->tp_name);
+    }
+    return NULL;
+  }
+
+  ESPathObject* self = PyObject_New(ESPathObject, &ESPath_Type);
+  PyObject* steps = PyList_AsTuple(list);
+  Py_DECREF(list);
+  PyObject* keys = steps ? PyTuple_New(PyTuple_GET_SIZE(steps)) : NULL;
+  PyObject* ckeys = steps ? PyTuple_New(PyTuple_GET_SIZE(steps)) : NULL;
+  if (!self || !keys || !ckeys) {
+    Py_XDECREF(steps);
+    Py_XDECREF(keys);
+    Py_XDECREF(ckeys);
+    if (self) {
+      self->steps = self->keys = self->ckeys = NULL;
+      Py_DECREF(self);
+    }
+    return NULL;
+  }
+  self->steps = steps;
+  self->keys = keys;
+  self->ckeys = ckeys;
+
+  uint64_t sizehint = 16;
+  ESEncodeOpts compact = {.compact = 1};
+  for (Py_ssize_t idx = 0; idx < PyTuple_GET_SIZE(steps); ++idx) {
+    PyObject* step = PyTuple_GET_ITEM(steps, idx);
+    PyObject* key = ESCODE_encode_bytes(step, &sizehint, NULL);
+    if (!key) {
+      Py_DECREF(self);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(keys, idx, key);
+    PyObject* ckey = ESCODE_encode_bytes(step, &sizehint, &compact);
+    if (!ckey) {
+      Py_DECREF(self);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(ckeys, idx, ckey);
+  }
+  return self;
+}
+
+/* Whether the encoding at str of at most left bytes starts with key's.
+ * Encodings are self delimiting: a match of the whole key is the key. */
+#define espath_keyat(str, left, key)                                    \
+  ((uint64_t)PyBytes_GET_SIZE(key) <= (left) &&                         \
+   !memcmp((str), PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key)))
+
+/* Point start..end, a key's encoding, at the str it refers back to if it
+ * is a back reference (the skip over it checked where it points). 0 if
+ * that str is cut short. */
+static inline int
+espath_deref(ESReader* buf, uint64_t* start, uint64_t* end)
+{
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+
+  byte headbyte = buf->str[*start];
+  if (headbyte >> 4 != ESTYPE_REF || !(headbyte & 0x08)) return 1;
+  ESHEAD_INITDECODE(eshead, headbyte);
+  const byte* bytes = buf->str + *start + 1;
+  ESHEAD_DECODELEN(eshead, bytes);
+
+  ESReader str = {buf->str, *start - eshead->val.u64, buf->size};
+  *start = str.offset;
+  if (!decode_skip(&str)) return 0;
+  *end = str.offset;
+  return 1;
+}
+
+/**
+ * Step buf, at the first of a dict's len entries, over entries until one
+ * whose key's encoding (either form, or that of the str a back reference
+ * is to) matches, leaving buf at its value. key and ckey are the default
+ * and compact encodings of the key. Returns 1 when found, 0 if not, -1 on
+ * error.
+ */
+static int
+espath_scankey(ESReader* buf, uint64_t len, PyObject* key, PyObject* ckey)
+{
+  bool compact = PyBytes_GET_SIZE(ckey) < PyBytes_GET_SIZE(key);
+
+  for (; len; --len) {
+    uint64_t start = buf->offset;
+    if (!decode_skip(buf)) goto truncated;
+    uint64_t end = buf->offset;
+    if (!espath_deref(buf, &start, &end)) goto truncated;
+    uint64_t keylen = end - start;
+    if ((keylen == (uint64_t)PyBytes_GET_SIZE(key) &&
+         espath_keyat(buf->str + start, keylen, key)) ||
+        (compact && keylen == (uint64_t)PyBytes_GET_SIZE(ckey) &&
+         espath_keyat(buf->str + start, keylen, ckey))) {
+      return 1;
+    }
+    if (!decode_skip(buf)) goto truncated;
+  }
+  return 0;
+
+ truncated:
+  if (!PyErr_Occurred()) {
+    PyErr_SetString(ESCODE_DecodeError, "truncated input");
+  }
+  return -1;
+}
+
+/**
+ * Look up a key with a dict's lookup table, buf being at its first entry,
+ * and leave buf at the key's value. The table hashes keys as they were
+ * written, so each form is looked up. Returns as espath_scankey.
+ */
+static int
+espath_tablekey(ESReader* buf, ESTable* table, PyObject* key, PyObject* ckey)
+{
+  PyObject* forms[2] = {key, ckey};
+  int nforms = PyBytes_GET_SIZE(ckey) < PyBytes_GET_SIZE(key) ? 2 : 1;
+  uint64_t items = buf->offset, left = buf->size - items;
+
+  for (int form = 0; form < nforms; ++form) {
+    PyObject* probe = forms[form];
+    uint32_t hash = estable_hash((const byte*)PyBytes_AS_STRING(probe),
+                                 PyBytes_GET_SIZE(probe));
+    for (uint64_t entry = estable_find(table, hash);
+         entry < table->count && estable_hashat(table, entry) == hash;
+         ++entry) {
+      uint64_t offset = estable_offset(table, entry);
+      if (offset >= left) {
+        PyErr_SetString(ESCODE_DecodeError, "lookup table offset past the input");
+        return -1;
+      }
+      if (espath_keyat(buf->str + items + offset, left - offset, probe)) {
+        buf->offset = items + offset + PyBytes_GET_SIZE(probe);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Index step into a sequence of len items: the position, or -1 if the
+ * step is not an int or out of range */
+static inline int64_t
+espath_index(PyObject* step, uint64_t len)
+{
+  if (!PyLong_Check(step)) return -1;
+  int overflow;
+  long long at = PyLong_AsLongLongAndOverflow(step, &overflow);
+  if (overflow) return -1;
+  if (at < 0) at += (long long)len;
+  if (at < 0 || (uint64_t)at >= len) return -1;
+  return at;
+}
+
+/**
+ * Move buf to the value at path. A list or tuple is stepped into by
+ * skipping to the index, a dict by skipping entries until the key's
+ * encoding (either form, or that of the str a back reference is to)
+ * matches. With a lookup table, the index is looked up instead, and the
+ * key among the table's entries with its hash. An item of a packed array
+ * is no value of its own, so it ends the path and is decoded into *item.
+ * Returns 1 when found, 0 if some step is missing or lands on a value
+ * that can not be stepped into, -1 on error.
+ */
+static int
+espath_walk(ESReader* buf, ESPathObject* path, PyObject** item)
+{
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+  ESTable table;
+
+  for (Py_ssize_t idx = 0; idx < PyTuple_GET_SIZE(path->steps); ++idx) {
+    PyObject* step = PyTuple_GET_ITEM(path->steps, idx);
+    if (!decode_table(buf, &table)) goto truncated;
+    if (buf->offset >= buf->size) goto truncated;
+
+    byte headbyte = buf->str[buf->offset];
+    byte type = headbyte >> 4;
+    bool bit = (headbyte >> 3) & 1;
+
+    if (type == ESTYPE_ARRAY) {
+      if (idx + 1 < PyTuple_GET_SIZE(path->steps)) return 0;
+      ESHEAD_INITDECODE(eshead, headbyte);
+      ++buf->offset;
+      byte code;
+      const byte* data = decode_arrayhead(buf, eshead, &code);
+      if (!data) goto truncated;
+      int64_t at = espath_index(step, eshead->val.u64);
+      if (at < 0) return 0;
+      *item = decode_arrayitem(code, data, at);
+      return *item ? 1 : -1;
+    }
+
+    if (type != ESTYPE_LIST && !(type == ESTYPE_SET && bit)) {
+      return 0;
+    }
+
+    if (!decode_head(buf, eshead)) goto truncated;
+    uint64_t len = eshead->val.u64;
+
+    if (type == ESTYPE_LIST) {
+      int64_t at = espath_index(step, len);
+      if (at < 0) return 0;
+      if (table.width) {
+        uint64_t offset = estable_offset(&table, at);
+        if (offset >= buf->size - buf->offset) goto badtable;
+        buf->offset += offset;
+        continue;
+      }
+      for (; at; --at) {
+        if (!decode_skip(buf)) goto truncated;
+      }
+      continue;
+    }
+
+    PyObject* key = PyTuple_GET_ITEM(path->keys, idx);
+    PyObject* ckey = PyTuple_GET_ITEM(path->ckeys, idx);
+    int result = (table.width ?
+                  espath_tablekey(buf, &table, key, ckey) :
+                  espath_scankey(buf, len, key, ckey));
+    if (result <= 0) return result;
+  }
+  return 1;
+
+ truncated:
+  if (!PyErr_Occurred()) {
+    PyErr_SetString(ESCODE_DecodeError, "truncated input");
+  }
+  return -1;
+
+ badtable:
+  PyErr_SetString(ESCODE_DecodeError, "lookup table offset past the input");
+  return -1;
+}
+
+/**
+ * The value at path in the encoding at buf, decoded, or a new reference
+ * to dflt when the path is missing. NULL on error.
+ */
+static PyObject*
+espath_get(ESReader buf, ESPathObject* path, PyObject* dflt)
+{
+  PyObject* item = NULL;
+  int found = espath_walk(&buf, path, &item);
+  if (found < 0) return NULL;
+  if (!found) {
+    Py_INCREF(dflt);
+    return dflt;
+  }
+  if (item) return item;
+
+  ESDecodeOpts opts = {0};
+  return decode_object(&buf, &opts);
+}
+
+
+/* A new path is the empty one, the whole value, till __init__ compiles it */
+static PyObject*
+ESPath_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+  ESPathObject *self = (ESPathObject*)type->tp_alloc(type, 0);
+  if (!self) return NULL;
+  self->steps = PyTuple_New(0);
+  self->keys = PyTuple_New(0);
+  self->ckeys = PyTuple_New(0);
+  if (!self->steps || !self->keys || !self->ckeys) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject*)self;
+}
+
+static int
+ESPath_init(ESPathObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = {"path", NULL};
+  PyObject *spec;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:Path", kwlist, &spec)) {
+    return -1;
+  }
+
+  ESPathObject *path = espath_compile(spec);
+  if (!path) return -1;
+  Py_XSETREF(self->steps, path->steps);
+  Py_XSETREF(self->keys, path->keys);
+  Py_XSETREF(self->ckeys, path->ckeys);
+  Py_INCREF(self->steps);
+  Py_INCREF(self->keys);
+  Py_INCREF(self->ckeys);
+  Py_DECREF(path);
+  return 0;
+}
+
+static void
+ESPath_dealloc(ESPathObject *self)
+{
+  Py_XDECREF(self->steps);
+  Py_XDECREF(self->keys);
+  Py_XDECREF(self->ckeys);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject*
+ESPath_repr(ESPathObject *self)
+{
+  return PyUnicode_FromFormat("escode.Path(%R)", self->steps);
+}
+
+static PyMemberDef ESPath_members[] = {
+  {"steps", T_OBJECT, offsetof(ESPathObject, steps), READONLY,
+   PyDoc_STR("The dict keys and list indices walked, in order.")},
+  {NULL}  // sentinel
+};
+
+static PyTypeObject ESPath_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.Path",
+  .tp_basicsize = sizeof(ESPathObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("Path(path) -> a compiled path for escode.get and escode.project.\n"
+                      "path is a string like \"a.b[3]\" (str keys separated by '.', int keys\n"
+                      "or indices in brackets) or a list/tuple of keys and indices.\n"
+                      "Dict keys are matched by their encoding, so 1 does not match 1.0."),
+  .tp_dealloc = (destructor)ESPath_dealloc,
+  .tp_repr = (reprfunc)ESPath_repr,
+  .tp_members = ESPath_members,
+  .tp_init = (initproc)ESPath_init,
+  .tp_new = ESPath_new,
+};
+
+
+#endif //__ESCODE_PATH_H__
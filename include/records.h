@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Decoding runs of back-to-back records: escode.iter_decode over a
+ * buffer or a binary file, and escode.StreamDecoder fed in chunks
+ *
+ */
+
+#ifndef __ESCODE_RECORDS_H__
+#define __ESCODE_RECORDS_H__
+
+#include <Python.h>
+#include "core/strbuf.h"
+#include "core/keycache.h"
+#include "escode.h"
+#include "decoder.h"
+#include "tape.h"
+
+#define ESRECORDS_CHUNK 65536 // smallest read from a file
+
+/**
+ * Input read so far and not yet decoded: data[start:end], of size bytes
+ * allocated, where data[0] is at position base of the whole input.
+ */
+typedef struct ESPending {
+  byte *data;
+  uint64_t start;
+  uint64_t end;
+  uint64_t size;
+  uint64_t base;
+} ESPending;
+
+#define ESPending_INIT(pending) (*(pending) = (ESPending){0})
+#define ESPending_FREE(pending) (PyMem_Free((pending)->data), ESPending_INIT(pending))
+#define ESPending_LEN(pending) ((pending)->end - (pending)->start)
+
+/* Room for len more bytes at data + end, dropping what was consumed */
+static byte*
+espending_reserve(ESPending* pending, uint64_t len) {
+  if (pending->size - pending->end >= len) {
+    return pending->data + pending->end;
+  }
+
+  uint64_t used = ESPending_LEN(pending);
+  if (pending->start) {
+    memmove(pending->data, pending->data + pending->start, used);
+    pending->base += pending->start;
+    pending->start = 0;
+    pending->end = used;
+  }
+
+  if (pending->size - used < len) {
+    uint64_t size = pending->size ? pending->size : ESRECORDS_CHUNK;
+    while (size - used < len) {
+      if (size > PY_SSIZE_T_MAX / 2) {
+        PyErr_NoMemory();
+        return NULL;
+      }
+      size *= 2;
+    }
+    byte* data = PyMem_Realloc(pending->data, size);
+    if (!data) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+    pending->data = data;
+    pending->size = size;
+  }
+  return pending->data + pending->end;
+}
+
+static int
+espending_append(ESPending* pending, const byte* bytes, uint64_t len) {
+  if (!len) return 0;
+  byte* out = espending_reserve(pending, len);
+  if (!out) return -1;
+  memcpy(out, bytes, len);
+  pending->end += len;
+  return 0;
+}
+
+/**
+ * Decode the next record of pending, setting *at to its position. A
+ * record that runs past what was read is left for more input (NULL with
+ * no error set) unless final, when the input ends there and it is
+ * truncated. Completeness is checked with a scan of the record first, so
+ * a partial record is never half decoded.
+ */
+static PyObject*
+espending_next(ESPending* pending, ESDecodeOpts* opts, uint64_t* at, bool final) {
+  ESReader scan = {.str=pending->data, .offset=pending->start, .size=pending->end};
+  int status = estape_scan(&scan, NULL, ESCODE_maxdepth);
+  if (status == ESSCAN_TRUNCATED && !final) {
+    return NULL;
+  }
+  if (status != ESSCAN_OK) {
+    return decode_scanerror(&scan, scan.offset, status);
+  }
+
+  ESReader buf = {.str=pending->data, .offset=pending->start, .size=scan.offset};
+  PyObject* obj = decode_object(&buf, opts);
+  if (obj) {
+    *at = pending->base + pending->start;
+    pending->start = scan.offset;
+  }
+  return obj;
+}
+
+
+/**
+ * The iterator: over a buffer, records are decoded straight from the
+ * held view; over a file, chunks are read into pending as needed. Dict
+ * keys are shared across records through keys.
+ */
+typedef struct ESRecordsObject {
+  PyObject_HEAD
+  PyObject *read;
+  Py_buffer view;
+  uint64_t offset;
+  ESPending pending;
+  bool eof;
+  bool offsets;
+  ESKeyCache keys;
+} ESRecordsObject;
+
+static PyTypeObject ESRecords_Type;
+
+static void
+ESRecords_dealloc(ESRecordsObject *self)
+{
+  if (self->view.obj) {
+    PyBuffer_Release(&self->view);
+  }
+  Py_XDECREF(self->read);
+  ESPending_FREE(&self->pending);
+  ESKeyCache_CLEAR(&self->keys);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Read the next chunk of the file into pending, setting eof at its end */
+static int
+esrecords_read(ESRecordsObject *self)
+{
+  uint64_t want = ESPending_LEN(&self->pending);
+  if (want < ESRECORDS_CHUNK) want = ESRECORDS_CHUNK;
+
+  PyObject *chunk = PyObject_CallFunction(self->read, "K", (unsigned long long)want);
+  if (!chunk) return -1;
+  if (!PyBytes_Check(chunk)) {
+    PyErr_Format(PyExc_TypeError, "iter_decode() needs a binary file, read() returned %s",
+                 Py_TYPE(chunk)->tp_name);
+    Py_DECREF(chunk);
+    return -1;
+  }
+
+  int result = 0;
+  if (!PyBytes_GET_SIZE(chunk)) {
+    self->eof = 1;
+  } else {
+    result = espending_append(&self->pending, (byte*)PyBytes_AS_STRING(chunk),
+                              PyBytes_GET_SIZE(chunk));
+  }
+  Py_DECREF(chunk);
+  return result;
+}
+
+static PyObject*
+ESRecords_next(ESRecordsObject *self)
+{
+  ESDecodeOpts opts = {.keys = &self->keys};
+  PyObject *obj = NULL;
+  uint64_t at = 0;
+
+  if (!self->read) {
+    if (self->offset >= (uint64_t)self->view.len) {
+      return NULL;
+    }
+    ESReader buf = {.str=self->view.buf, .offset=self->offset, .size=self->view.len};
+    at = self->offset;
+    obj = decode_object(&buf, &opts);
+    if (!obj) return NULL;
+    self->offset = buf.offset;
+  } else {
+    while (1) {
+      if (!ESPending_LEN(&self->pending) && self->eof) {
+        return NULL;
+      }
+      if (ESPending_LEN(&self->pending)) {
+        obj = espending_next(&self->pending, &opts, &at, self->eof);
+        if (obj || PyErr_Occurred()) break;
+      }
+      if (esrecords_read(self) < 0) return NULL;
+    }
+    if (!obj) return NULL;
+  }
+
+  if (!self->offsets) {
+    return obj;
+  }
+  return Py_BuildValue("(KN)", (unsigned long long)at, obj);
+}
+
+static PyTypeObject ESRecords_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.RecordIterator",
+  .tp_basicsize = sizeof(ESRecordsObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("Iterator over back-to-back records, from escode.iter_decode."),
+  .tp_dealloc = (destructor)ESRecords_dealloc,
+  .tp_iter = PyObject_SelfIter,
+  .tp_iternext = (iternextfunc)ESRecords_next,
+};
+
+/* Iterator over the records of source, a buffer or a binary file */
+static PyObject*
+esrecords_new(PyObject *source, bool offsets)
+{
+  ESRecordsObject *self = PyObject_New(ESRecordsObject, &ESRecords_Type);
+  if (!self) return NULL;
+  self->read = NULL;
+  self->view.obj = NULL;
+  self->offset = 0;
+  self->eof = 0;
+  self->offsets = offsets;
+  ESPending_INIT(&self->pending);
+  ESKeyCache_INIT(&self->keys);
+
+  if (PyObject_CheckBuffer(source)) {
+    if (PyObject_GetBuffer(source, &self->view, PyBUF_SIMPLE) < 0) {
+      self->view.obj = NULL;
+      Py_DECREF(self);
+      return NULL;
+    }
+  } else if (!(self->read = PyObject_GetAttrString(source, "read"))) {
+    PyErr_Format(PyExc_TypeError, "iter_decode() takes a buffer or a binary file, not %s",
+                 Py_TYPE(source)->tp_name);
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject*)self;
+}
+
+
+/**
+ * StreamDecoder: records fed in chunks that need not line up with them.
+ * Whole records are decoded straight from each chunk; only a trailing
+ * partial record is copied, into pending, where later chunks are added
+ * to it. Its scan resumes where the last one ran out of input: scanned
+ * bytes of it are done and open holds the containers still being read.
+ */
+typedef struct ESStreamObject {
+  PyObject_HEAD
+  ESPending pending;
+  uint64_t scanned;
+  ESTapeStack open;
+  ESKeyCache keys;
+} ESStreamObject;
+
+static void
+esstream_reset(ESStreamObject *self)
+{
+  ESPending_FREE(&self->pending);
+  Vector_FREE(&self->open);
+  Vector_INIT(&self->open);
+  self->scanned = 0;
+}
+
+/* Set up the buffers in new, so a decoder never seen by __init__ works */
+static PyObject*
+ESStream_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+  ESStreamObject *self = (ESStreamObject*)type->tp_alloc(type, 0);
+  if (!self) return NULL;
+  ESPending_INIT(&self->pending);
+  Vector_INIT(&self->open);
+  ESKeyCache_INIT(&self->keys);
+  self->scanned = 0;
+  return (PyObject*)self;
+}
+
+static int
+ESStream_init(ESStreamObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = {NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":StreamDecoder", kwlist)) {
+    return -1;
+  }
+  esstream_reset(self);
+  ESKeyCache_CLEAR(&self->keys);
+  ESKeyCache_INIT(&self->keys);
+  return 0;
+}
+
+static void
+ESStream_dealloc(ESStreamObject *self)
+{
+  ESPending_FREE(&self->pending);
+  Vector_FREE(&self->open);
+  ESKeyCache_CLEAR(&self->keys);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/**
+ * Decode the whole records of data[start:end], the first scanned up to
+ * self->scanned already, into results. Returns where the records stop
+ * (the rest being a partial record), or -1 on error.
+ */
+static int64_t
+esstream_decode(ESStreamObject *self, const byte* data, uint64_t start, uint64_t end,
+                PyObject *results)
+{
+  ESDecodeOpts opts = {.keys = &self->keys};
+
+  while (start < end) {
+    ESReader scan = {.str=data, .offset=start + self->scanned, .size=end};
+    int status = estape_resume(&scan, NULL, &self->open, ESCODE_maxdepth);
+    if (status == ESSCAN_TRUNCATED) {
+      self->scanned = scan.offset - start;
+      break;
+    }
+    if (status != ESSCAN_OK) {
+      decode_scanerror(&scan, scan.offset, status);
+      return -1;
+    }
+
+    ESReader buf = {.str=data, .offset=start, .size=scan.offset};
+    PyObject *obj = decode_object(&buf, &opts);
+    int result = obj ? PyList_Append(results, obj) : -1;
+    Py_XDECREF(obj);
+    if (result < 0) return -1;
+
+    start = scan.offset;
+    self->scanned = 0;
+  }
+  return (int64_t)start;
+}
+
+static PyObject*
+ESStream_feed(ESStreamObject *self, PyObject *chunk)
+{
+  Py_buffer view;
+  if (ESCODE_getbuffer(chunk, &view) < 0) {
+    return NULL;
+  }
+
+  PyObject *results = PyList_New(0);
+  if (!results) goto error;
+
+  ESPending *pending = &self->pending;
+  if (!ESPending_LEN(pending)) {
+    // Nothing held back: decode from the chunk itself, keeping the tail
+    int64_t done = esstream_decode(self, view.buf, 0, view.len, results);
+    if (done < 0 ||
+        espending_append(pending, (byte*)view.buf + done, view.len - done) < 0) {
+      goto error;
+    }
+  } else {
+    if (espending_append(pending, view.buf, view.len) < 0) goto error;
+    int64_t done = esstream_decode(self, pending->data, pending->start, pending->end, results);
+    if (done < 0) goto error;
+    pending->start = done;
+  }
+
+  if (!ESPending_LEN(pending)) {
+    pending->base += pending->end;
+    pending->start = pending->end = 0;
+  }
+  ESCODE_releasebuffer(&view);
+  return results;
+
+ error:
+  // The stream is corrupt past here, start over from the next chunk
+  esstream_reset(self);
+  Py_XDECREF(results);
+  ESCODE_releasebuffer(&view);
+  return NULL;
+}
+
+static PyObject*
+ESStream_reset(ESStreamObject *self, PyObject *noargs)
+{
+  esstream_reset(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+ESStream_get_buffered(ESStreamObject *self, void *closure)
+{
+  return PyLong_FromUnsignedLongLong(ESPending_LEN(&self->pending));
+}
+
+static PyMethodDef ESStream_methods[] = {
+  {"feed", (PyCFunction)ESStream_feed, METH_O,
+   PyDoc_STR("feed(chunk) -> list of the records completed by chunk, any bytes-like\n"
+             "object. A partial record at its end is kept for the next feed.")},
+  {"reset", (PyCFunction)ESStream_reset, METH_NOARGS,
+   PyDoc_STR("reset() -> drop any partial record.")},
+  {NULL, NULL}  // sentinel
+};
+
+static PyGetSetDef ESStream_getset[] = {
+  {"buffered", (getter)ESStream_get_buffered, NULL,
+   PyDoc_STR("Bytes of a partial record held back, 0 at a record boundary."), NULL},
+  {NULL}  // sentinel
+};
+
+static PyTypeObject ESStream_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "escode.StreamDecoder",
+  .tp_basicsize = sizeof(ESStreamObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = PyDoc_STR("StreamDecoder() -> incremental decoder for back-to-back records\n"
+                      "arriving in arbitrary chunks, e.g. from a socket or an asyncio\n"
+                      "Protocol.data_received. Dict keys are shared across records.\n"
+                      "A corrupt record raises from feed and resets the decoder."),
+  .tp_methods = ESStream_methods,
+  .tp_getset = ESStream_getset,
+  .tp_init = (initproc)ESStream_init,
+  .tp_dealloc = (destructor)ESStream_dealloc,
+  .tp_new = ESStream_new,
+};
+
+
+#endif //__ESCODE_RECORDS_H__
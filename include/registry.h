@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Type dispatch for the encoder and the extension type registry
+ *
+ */
+
+#ifndef __ESCODE_REGISTRY_H__
+#define __ESCODE_REGISTRY_H__
+
+#include "core/mypython.h"
+#include "core/constants.h"
+#include "escode.h"
+
+/* How the encoder handles an exact type */
+#define ESKIND_UNSUPPORTED 0
+#define ESKIND_INT 1
+#define ESKIND_FLOAT 2
+#define ESKIND_DEC 3
+#define ESKIND_BYTES 4
+#define ESKIND_UNICODE 5
+#define ESKIND_LIST 6
+#define ESKIND_TUPLE 7
+#define ESKIND_SET 8
+#define ESKIND_DICT 9
+#define ESKIND_EXT 10
+#define ESKIND_CONST 11 // None and bools, matched by identity before dispatch
+#define ESKIND_ARRAY 12 // array.array
+#define ESKIND_BUFFER 13 // bytearray and memoryview
+
+/**
+ * A registered extension type. Its objects are written as an ESTYPE_EXT
+ * head carrying the code, followed by whatever encode(obj) returned; decode
+ * rebuilds the object from that value. The hooks are either Python
+ * callables or C functions, both returning a new reference (NULL on error).
+ */
+typedef PyObject* (*ESExtHook)(PyObject*);
+
+typedef struct ESExtType {
+  PyTypeObject *type;  // NULL when the code is free
+  PyObject *encode;
+  PyObject *decode;
+  ESExtHook cencode;
+  ESExtHook cdecode;
+} ESExtType;
+
+static ESExtType ESCODE_exttypes[ESEXT_MAXCODE + 1];
+
+/**
+ * Open addressed map from exact type to its kind, probed linearly from a
+ * hash of the type pointer. It is sized for every builtin and extension
+ * code at under half load, and rebuilt whenever the registry changes.
+ */
+typedef struct ESTypeSlot {
+  PyTypeObject *type;
+  byte kind;
+  byte code;
+} ESTypeSlot;
+
+#define ESTYPEMAP_SIZE 1024
+#define _ESTYPEMAP_HASH(type)                                           \
+  ((((uintptr_t)(type)) >> 4) & (ESTYPEMAP_SIZE - 1))
+
+static ESTypeSlot ESCODE_typemap[ESTYPEMAP_SIZE];
+
+/* Slot for type: its entry, or the empty (ESKIND_UNSUPPORTED) slot */
+static inline ESTypeSlot*
+estypemap_find(PyTypeObject* type) {
+  size_t idx = _ESTYPEMAP_HASH(type);
+  while (ESCODE_typemap[idx].type && ESCODE_typemap[idx].type != type) {
+    idx = (idx + 1) & (ESTYPEMAP_SIZE - 1);
+  }
+  return &ESCODE_typemap[idx];
+}
+
+static inline void
+estypemap_add(PyTypeObject* type, byte kind, byte code) {
+  ESTypeSlot* slot = estypemap_find(type);
+  *slot = (ESTypeSlot){type, kind, code};
+}
+
+static void
+estypemap_build() {
+  memset(ESCODE_typemap, 0, sizeof(ESCODE_typemap));
+
+  estypemap_add(Py_TYPE(Py_None), ESKIND_CONST, 0);
+  estypemap_add(&PyBool_Type, ESKIND_CONST, 0);
+  estypemap_add(&PyLong_Type, ESKIND_INT, 0);
+  estypemap_add(&PyFloat_Type, ESKIND_FLOAT, 0);
+#if PY_VERSION_HEX >= 0x03030000
+  estypemap_add(MyPyDec_Type, ESKIND_DEC, 0);
+#endif
+  estypemap_add(&PyBytes_Type, ESKIND_BYTES, 0);
+  estypemap_add(&PyUnicode_Type, ESKIND_UNICODE, 0);
+  estypemap_add(&PyList_Type, ESKIND_LIST, 0);
+  estypemap_add(&PyTuple_Type, ESKIND_TUPLE, 0);
+  estypemap_add(&PySet_Type, ESKIND_SET, 0);
+  estypemap_add(&PyFrozenSet_Type, ESKIND_SET, 0);
+  estypemap_add(&PyDict_Type, ESKIND_DICT, 0);
+  estypemap_add(&PyByteArray_Type, ESKIND_BUFFER, 0);
+  estypemap_add(&PyMemoryView_Type, ESKIND_BUFFER, 0);
+  if (MyPyArray_Type) {
+    estypemap_add(MyPyArray_Type, ESKIND_ARRAY, 0);
+  }
+
+  for (int code = 0; code <= ESEXT_MAXCODE; ++code) {
+    if (ESCODE_exttypes[code].type) {
+      estypemap_add(ESCODE_exttypes[code].type, ESKIND_EXT, code);
+    }
+  }
+}
+
+/* Drop the registration of code, if any */
+static void
+esext_clear(int code) {
+  ESExtType* ext = &ESCODE_exttypes[code];
+  Py_CLEAR(ext->type);
+  Py_CLEAR(ext->encode);
+  Py_CLEAR(ext->decode);
+  ext->cencode = ext->cdecode = NULL;
+}
+
+/**
+ * Register type under code with either the Python or the C hooks. A type
+ * is registered under one code only, and a code taken by another type or
+ * a builtin type is refused with ValueError.
+ */
+static int
+esext_register(PyTypeObject* type, int code,
+               PyObject* encode, PyObject* decode,
+               ESExtHook cencode, ESExtHook cdecode) {
+
+  if (code < 0 || code > ESEXT_MAXCODE) {
+    PyErr_Format(PyExc_ValueError, "extension code must be in 0..%d", ESEXT_MAXCODE);
+    return -1;
+  }
+
+  ESTypeSlot* slot = estypemap_find(type);
+  if (slot->type && slot->kind != ESKIND_EXT) {
+    PyErr_Format(PyExc_ValueError, "%s is encoded natively", type->tp_name);
+    return -1;
+  }
+
+  PyTypeObject* owner = ESCODE_exttypes[code].type;
+  if (owner && owner != type) {
+    PyErr_Format(PyExc_ValueError, "extension code %d is taken by %s",
+                 code, owner->tp_name);
+    return -1;
+  }
+
+  if (slot->type) {
+    esext_clear(slot->code);
+  }
+
+  ESExtType* ext = &ESCODE_exttypes[code];
+  Py_INCREF(type);
+  Py_XINCREF(encode);
+  Py_XINCREF(decode);
+  *ext = (ESExtType){type, encode, decode, cencode, cdecode};
+
+  estypemap_build();
+  return 0;
+}
+
+static int
+esext_unregister(PyTypeObject* type) {
+  ESTypeSlot* slot = estypemap_find(type);
+  if (!slot->type || slot->kind != ESKIND_EXT) {
+    PyErr_Format(PyExc_KeyError, "%s is not registered", type->tp_name);
+    return -1;
+  }
+
+  esext_clear(slot->code);
+  estypemap_build();
+  return 0;
+}
+
+/* The hook may unregister itself, so hold on to it for the call */
+static inline PyObject*
+_esext_call(PyObject* hook, PyObject* arg) {
+  Py_INCREF(hook);
+  PyObject* result = PyObject_CallFunctionObjArgs(hook, arg, NULL);
+  Py_DECREF(hook);
+  return result;
+}
+
+/* Value to encode in place of object (new reference, NULL on error) */
+static inline PyObject*
+esext_encode(int code, PyObject* object) {
+  ESExtType* ext = &ESCODE_exttypes[code];
+  if (ext->cencode) {
+    return ext->cencode(object);
+  }
+  return _esext_call(ext->encode, object);
+}
+
+/* Object for the decoded value of an extension code (new reference) */
+static inline PyObject*
+esext_decode(uint64_t code, PyObject* value) {
+  if (code > ESEXT_MAXCODE || !ESCODE_exttypes[code].type) {
+    PyErr_Format(ESCODE_DecodeError, "Unregistered extension code: %llu",
+                 (unsigned long long)code);
+    return NULL;
+  }
+  ESExtType* ext = &ESCODE_exttypes[code];
+  if (ext->cdecode) {
+    return ext->cdecode(value);
+  }
+  return _esext_call(ext->decode, value);
+}
+
+
+#endif //__ESCODE_REGISTRY_H__
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2014 Akhil Wable
+ * Author: Akhil Wable <awable@gmail.com>
+ *
+ * Two stage decoding: a scan of the encoding into a tape, which needs
+ * neither Python objects nor the GIL, then objects built from the tape
+ *
+ */
+
+#ifndef __ESCODE_TAPE_H__
+#define __ESCODE_TAPE_H__
+
+#include "core/strbuf.h"
+#include "core/eshead.h"
+#include "core/stack.h"
+#include "decoder.h"
+
+#define ESTAPE_NOGILMIN 4096  // smaller blobs are scanned holding the GIL
+
+/**
+ * One value in the encoding, in the order they are written: where its
+ * head is, and whether it is a str the scan found to be all ASCII, which
+ * stage two copies without checking. Lengths are read from the heads,
+ * which presize containers exactly.
+ */
+typedef struct ESTapeEntry {
+  uint64_t head;
+  bool ascii;
+} ESTapeEntry;
+
+VECTOR_TYPE(ESTape, ESTapeEntry, 64);
+
+/* A container being scanned: how many values it still holds */
+typedef struct ESTapeOpen {
+  uint64_t left;
+} ESTapeOpen;
+
+VECTOR_TYPE(ESTapeStack, ESTapeOpen, 32);
+
+/**
+ * Scan at buf, checking values are complete, only have known types and
+ * valid UTF-8 strings, and nest at most maxdepth deep, until the value
+ * that was open in stack (or, if it is empty, the one at buf) is whole.
+ * Entries are appended to tape unless it is NULL. Returns an ESSCAN_
+ * status and leaves buf after the value, or at the head it stopped at;
+ * stack then holds the containers still open, so a scan that ran out of
+ * input can resume there once more of it has arrived.
+ */
+static int
+estape_resume(ESReader* buf, ESTape* tape, ESTapeStack* stack, uint32_t maxdepth) {
+
+  ESTapeOpen* open;
+  uint64_t len, items;
+  bool ascii;
+  int status = ESSCAN_OK;
+
+  while (1) {
+    uint64_t head = buf->offset;
+    if (!decode_scan(buf, 1, &len, &items, &ascii, &status)) {
+      buf->offset = head;
+      break;
+    }
+
+    if (tape) {
+      ESTapeEntry* entry = Vector_PUSH(tape);
+      if (!entry) {
+        status = ESSCAN_NOMEM;
+        break;
+      }
+      *entry = (ESTapeEntry){head, ascii};
+    }
+
+    if (items) {
+      if (Vector_LEN(stack) >= maxdepth) {
+        buf->offset = head;
+        status = ESSCAN_TOODEEP;
+        break;
+      }
+      if (!(open = Vector_PUSH(stack))) {
+        status = ESSCAN_NOMEM;
+        break;
+      }
+      *open = (ESTapeOpen){items};
+      continue;
+    }
+
+    // Close every container this value completes
+    while ((open = Vector_TOP(stack)) && !--open->left) {
+      Vector_POP(stack);
+    }
+    if (!open) break;
+  }
+
+  return status;
+}
+
+/* Scan one value at buf, see estape_resume */
+static int
+estape_scan(ESReader* buf, ESTape* tape, uint32_t maxdepth) {
+  ESTapeStack _stack; // Allocate on stack
+  ESTapeStack* stack = &_stack;
+  Vector_INIT(stack);
+
+  int status = estape_resume(buf, tape, stack, maxdepth);
+  Vector_FREE(stack);
+  return status;
+}
+
+/**
+ * Build the objects for a scanned value from its tape. Each entry's value
+ * is read at its head, and containers are filled as in decode_object, the
+ * scan having vetted the lengths, nesting and strings already: an ASCII
+ * str is copied as it is, without looking for other characters again.
+ */
+static PyObject*
+estape_decode(ESReader* buf, ESTape* tape, ESDecodeOpts* opts) {
+
+  eshead_t _eshead; // Allocate on stack
+  eshead_t* eshead = &_eshead;
+
+  ESDecodeStack _stack; // Allocate on stack
+  ESDecodeStack* stack = &_stack;
+  Vector_INIT(stack);
+
+  ESDecodeStrs _strs; // Allocate on stack
+  opts->strs = &_strs;
+  Vector_INIT(opts->strs);
+
+  PyObject* result = NULL;
+  for (uint64_t idx = 0; idx < Vector_LEN(tape); ++idx) {
+    ESTapeEntry* entry = Vector_AT(tape, idx);
+    buf->offset = entry->head;
+    opts->ascii = entry->ascii;
+    PyObject* obj = decode_object_body(buf, eshead, opts, decode_iskey(stack));
+    if (!obj) break;
+
+    if (decode_isopen(eshead)) {
+      if (!decode_open(stack, eshead, obj)) break;
+      continue;
+    }
+
+    int open = decode_close(stack, &obj);
+    if (open < 0) break;
+    if (!open) {
+      Vector_FREE(stack);
+      result = obj;
+      break;
+    }
+  }
+
+  if (!result) {
+    decode_unwind(stack);
+  }
+  opts->ascii = 0;
+  decode_unshare(opts);
+  return result;
+}
+
+/**
+ * Scan the value at buf into a tape, releasing the GIL for big inputs,
+ * then build it. The input must stay put while the GIL is released: the
+ * caller holds a buffer view or an immutable bytes.
+ */
+static PyObject*
+estape_decode_nogil(ESReader* buf, ESDecodeOpts* opts) {
+  ESTape _tape; // Allocate on stack
+  ESTape* tape = &_tape;
+  Vector_INIT(tape);
+
+  uint64_t head = buf->offset;
+  uint32_t maxdepth = ESCODE_maxdepth;
+  int status;
+  if (buf->size - buf->offset >= ESTAPE_NOGILMIN) {
+    Py_BEGIN_ALLOW_THREADS
+    status = estape_scan(buf, tape, maxdepth);
+    Py_END_ALLOW_THREADS
+  } else {
+    status = estape_scan(buf, tape, maxdepth);
+  }
+
+  PyObject* result = NULL;
+  if (status != ESSCAN_OK) {
+    decode_scanerror(buf, buf->offset, status);
+  } else {
+    uint64_t end = buf->offset;
+    buf->offset = head;
+    result = estape_decode(buf, tape, opts);
+    buf->offset = end;
+  }
+
+  Vector_FREE(tape);
+  return result;
+}
+
+
+#endif //__ESCODE_TAPE_H__
@@ -22,3 +22,56 @@ class TestBinary(TestCase):
 
         nums = list(struct.unpack(self.format, decoded))
         self.assertEqual(nums, self.nums)
+
+
+class TestMemoryviewResults(TestCase):
+    def setUp(self):
+        self.big = bytes(bytearray(range(256))) * 400
+        self.obj = {u'image': self.big, u'small': b'abc', u'text': u'x' * 5000,
+                    u'nested': [self.big[:2000], (b'',)]}
+        self.blob = escode.encode(self.obj)
+
+    def test_threshold(self):
+        dec = escode.Decoder(memoryview_threshold=1024)
+        out = dec.decode(self.blob)
+        self.assertIsInstance(out[u'image'], memoryview)
+        self.assertIsInstance(out[u'nested'][0], memoryview)
+        self.assertIsInstance(out[u'small'], bytes)
+        self.assertIsInstance(out[u'text'], str)
+        self.assertEqual(out[u'image'], self.big)
+        self.assertEqual(out[u'nested'][0].tobytes(), self.big[:2000])
+        self.assertEqual(out[u'nested'][1], (b'',))
+
+    def test_views_are_readonly_slices_of_the_input(self):
+        data = bytearray(self.blob)
+        out = escode.Decoder(memoryview_threshold=1024).decode(data)
+        view = out[u'image']
+        self.assertTrue(view.readonly)
+        self.assertIs(view.obj, data)
+        # the input stays alive (and exported) through the view
+        with self.assertRaises(BufferError):
+            data.extend(b'x')
+        del data
+        self.assertEqual(view.tobytes(), self.big)
+
+    def test_default_copies(self):
+        for dec in (escode, escode.Decoder(), escode.Decoder(memoryview_threshold=None)):
+            out = dec.decode(self.blob)
+            self.assertIsInstance(out[u'image'], bytes)
+            self.assertEqual(out, self.obj)
+
+    def test_zero_threshold_views_all_bytes(self):
+        out = escode.Decoder(memoryview_threshold=0).decode(self.blob)
+        self.assertIsInstance(out[u'small'], memoryview)
+        self.assertEqual(out[u'small'], b'abc')
+
+    def test_truncated(self):
+        dec = escode.Decoder(memoryview_threshold=16)
+        with self.assertRaises(escode.DecodeError):
+            dec.decode(self.blob[:len(self.blob) // 2])
+
+    def test_bad_threshold(self):
+        with self.assertRaises((OverflowError, ValueError)):
+            escode.Decoder(memoryview_threshold=-1)
+        with self.assertRaises(TypeError):
+            escode.Decoder(memoryview_threshold=u'big')
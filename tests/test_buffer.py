@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import array
+import mmap
+import escode
+
+
+class TestDecodeBuffers(TestCase):
+    def setUp(self):
+        self.obj = {u'id': 12, u'name': u'record', u'blob': b'\x00' * 600,
+                    u'vals': [1.5, None, (True, -3)]}
+        self.enc = escode.encode(self.obj)
+
+    def test_bytearray(self):
+        self.assertEqual(escode.decode(bytearray(self.enc)), self.obj)
+
+    def test_memoryview_slice(self):
+        framed = b'\xaa' * 5 + self.enc + b'\xbb' * 7
+        view = memoryview(framed)[5:5 + len(self.enc)]
+        self.assertEqual(escode.decode(view), self.obj)
+        # decoded values do not keep the buffer
+        view.release()
+
+    def test_mmap(self):
+        mm = mmap.mmap(-1, len(self.enc))
+        mm.write(self.enc)
+        self.assertEqual(escode.decode(mm), self.obj)
+        mm.close()
+
+    def test_array(self):
+        arr = array.array('B', self.enc)
+        self.assertEqual(escode.decode(arr), self.obj)
+
+    def test_decoder(self):
+        dec = escode.Decoder()
+        self.assertEqual(dec.decode(bytearray(self.enc)), self.obj)
+        self.assertEqual(dec.decode(memoryview(self.enc)), self.obj)
+
+    def test_large_blob(self):
+        objs = [self.obj] * 20
+        self.assertEqual(escode.decode(bytearray(escode.encode(objs))), objs)
+
+    def test_empty_and_truncated(self):
+        self.assertIsNone(escode.decode(bytearray()))
+        with self.assertRaises(escode.DecodeError):
+            escode.decode(memoryview(self.enc)[:-1])
+
+    def test_non_contiguous(self):
+        with self.assertRaises(BufferError):
+            escode.decode(memoryview(self.enc)[::2])
+
+    def test_buffer_held_while_decoding(self):
+        def decode_hook(value):
+            # the bytearray is exported, so it can not be resized under us
+            with self.assertRaises(BufferError):
+                data.extend(b'\x00' * 4096)
+            return Marker()
+
+        escode.register(Marker, 3, lambda m: 0, decode_hook)
+        try:
+            data = bytearray(escode.encode([Marker(), 1, 2]))
+            self.assertEqual(len(escode.decode(data)), 3)
+        finally:
+            escode.unregister(Marker)
+
+
+class TestEncodeBuffers(TestCase):
+    def setUp(self):
+        self.data = bytes(bytearray(range(256))) * 4
+
+    def test_bytes_like(self):
+        blob = escode.encode(self.data)
+        mm = mmap.mmap(-1, len(self.data))
+        mm.write(self.data)
+        for value in (bytearray(self.data), memoryview(self.data),
+                      memoryview(bytearray(self.data))[:], mm):
+            self.assertEqual(escode.encode(value), blob)
+            self.assertEqual(escode.encoded_size(value), len(blob))
+            self.assertEqual(escode.decode(escode.encode([value])), [self.data])
+        mm.close()
+        self.assertEqual(escode.encode_index((bytearray(b'ab'), 1)),
+                         escode.encode_index((b'ab', 1)))
+
+    def test_decoded_memoryview(self):
+        blob = escode.encode({u'blob': self.data})
+        out = escode.Decoder(memoryview_threshold=16).decode(blob)
+        self.assertIsInstance(out[u'blob'], memoryview)
+        self.assertEqual(escode.encode(out), blob)
+
+    def test_typed_views(self):
+        floats = array.array('d', [0.5, -2.0, 1e300])
+        view = memoryview(floats.tobytes()).cast('d')
+        self.assertEqual(escode.encode(view), escode.encode(floats))
+        self.assertEqual(escode.decode(escode.encode(view)), floats.tolist())
+        grid = memoryview(array.array('i', range(6))).cast('B').cast('i', [2, 3])
+        self.assertEqual(escode.decode(escode.encode(grid)), list(range(6)))
+        self.assertEqual(escode.decode(escode.encode(memoryview(self.data).cast('c'))),
+                         self.data)
+        with self.assertRaises(escode.EncodeError):
+            escode.encode_index((view,))
+
+    def test_unsigned_range(self):
+        for code in 'BHIQ':
+            value = array.array(code, [0, 1, 2 ** (8 * array.array(code).itemsize) - 1])
+            self.assertEqual(escode.decode(escode.encode(value)), value.tolist())
+
+    def test_non_contiguous(self):
+        with self.assertRaises(BufferError):
+            escode.encode(memoryview(self.data)[::2])
+
+
+class Marker(object):
+    pass
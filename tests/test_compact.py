@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import escode
+
+
+class TestCompact(TestCase):
+    def setUp(self):
+        self.encoder = escode.Encoder(compact=True)
+        self.records = [{u'id': i, u'name': u'user%d' % i, u'age': 20 + i % 50,
+                         u'tags': [u'a', u'b'], u'active': i % 2 == 0,
+                         u'score': i % 16, u'bio': u'x' * (i % 40)}
+                        for i in range(200)]
+
+    def roundtrip(self, value):
+        blob = self.encoder.encode(value)
+        self.assertEqual(escode.decode(blob), value)
+        self.assertEqual(escode.validate(blob), len(blob))
+        self.assertEqual(escode.Decoder(release_gil=True).decode(blob), value)
+        self.assertEqual(escode.Decoder(cache_keys=True).decode(blob), value)
+        return blob
+
+    def test_tiny_values(self):
+        self.assertEqual(self.encoder.encode(0), b'\xc0')
+        self.assertEqual(self.encoder.encode(15), b'\xcf')
+        self.assertEqual(self.encoder.encode(u''), b'\xd0')
+        self.assertEqual(self.encoder.encode(u'id'), b'\xd2id')
+        self.assertEqual(self.encoder.encode(16), escode.encode(16))
+        self.assertEqual(self.encoder.encode(-1), escode.encode(-1))
+        self.assertEqual(self.encoder.encode(u'x' * 16), escode.encode(u'x' * 16))
+        self.assertEqual(self.encoder.encode(b'id'), escode.encode(b'id'))
+        for value in (0, 7, 15, 16, -1, True, u'', u'\xe9t\xe9', u'x' * 15, u'x' * 16,
+                      b'', [0, 1, u'a', {u'k': 3}], (15, u'€' * 5)):
+            self.roundtrip(value)
+        self.assertIs(type(escode.decode(self.encoder.encode(True))), bool)
+
+    def test_smaller(self):
+        blob = self.roundtrip(self.records)
+        self.assertLess(len(blob), len(escode.encode(self.records)) * 0.9)
+        self.assertFalse(escode.Encoder().compact)
+        self.assertTrue(self.encoder.compact)
+
+    def test_paths_and_tables(self):
+        data = {u'orders': [{u'id': i, 3: u'three', u'long key name here': i}
+                            for i in range(80)]}
+        for encoder in (self.encoder, escode.Encoder(compact=True, table_min=4)):
+            blob = encoder.encode(data)
+            self.assertEqual(escode.get(blob, u'orders[5].id'), 5)
+            self.assertEqual(escode.get(blob, [u'orders', 7, 3]), u'three')
+            self.assertEqual(escode.get(blob, [u'orders', 9, u'long key name here']), 9)
+            self.assertIsNone(escode.get(blob, u'orders[5].missing', None))
+            self.assertEqual(escode.project(blob, [u'orders[1].id']), {u'orders[1].id': 1})
+            lazy = escode.loads_lazy(blob)
+            self.assertEqual(lazy[u'orders'][3][u'id'], 3)
+
+    def test_streams(self):
+        blob = b''.join(self.encoder.encode(record) for record in self.records[:20])
+        self.assertEqual(list(escode.iter_decode(blob)), self.records[:20])
+        decoder = escode.StreamDecoder()
+        out = []
+        for pos in range(0, len(blob), 7):
+            out.extend(decoder.feed(blob[pos:pos + 7]))
+        self.assertEqual(out, self.records[:20])
+
+    def test_corrupt(self):
+        with self.assertRaises(escode.DecodeError):
+            escode.decode(b'\xd3ab')
+        with self.assertRaises(escode.DecodeError):
+            escode.validate(b'\xd2\xff\xfe')
+        with self.assertRaises(escode.DecodeError):
+            escode.decode(b'\xe0')
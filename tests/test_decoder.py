@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import escode
+
+
+class TestDecoder(TestCase):
+    def setUp(self):
+        self.recs = [{u'id': i, u'name': u'rec%d' % i, u'caf\xe9': i % 3,
+                      u'k' * 100: None, b'raw': [i], 7: {u'id': -i}}
+                     for i in range(50)]
+        self.blobs = [escode.encode(rec) for rec in self.recs]
+
+    def test_matches_decode(self):
+        dec = escode.Decoder()
+        for _ in range(2):
+            for rec, blob in zip(self.recs, self.blobs):
+                self.assertEqual(dec.decode(blob), rec)
+
+    def test_keys_shared_across_calls(self):
+        dec = escode.Decoder()
+        first, second = dec.decode(self.blobs[0]), dec.decode(self.blobs[1])
+        for key in (u'id', u'name', u'caf\xe9'):
+            k1 = [k for k in first if k == key][0]
+            k2 = [k for k in second if k == key][0]
+            self.assertIs(k1, k2)
+        self.assertIs([k for k in first[7]][0], [k for k in first if k == u'id'][0])
+
+    def test_cache_keys_off(self):
+        dec = escode.Decoder(cache_keys=False)
+        first, second = dec.decode(self.blobs[0]), dec.decode(self.blobs[1])
+        self.assertEqual(first, self.recs[0])
+        k1 = [k for k in first if k == u'name'][0]
+        k2 = [k for k in second if k == u'name'][0]
+        self.assertIsNot(k1, k2)
+
+    def test_module_decode_shares_keys_in_large_blobs(self):
+        recs = escode.decode(escode.encode(self.recs))
+        self.assertEqual(recs, self.recs)
+        k1 = [k for k in recs[0] if k == u'name'][0]
+        k2 = [k for k in recs[-1] if k == u'name'][0]
+        self.assertIs(k1, k2)
+
+    def test_many_distinct_keys(self):
+        # More keys than cache entries: collisions must only cost sharing
+        obj = dict((u'key%d' % i, i) for i in range(5000))
+        dec = escode.Decoder()
+        for _ in range(2):
+            self.assertEqual(dec.decode(escode.encode(obj)), obj)
+        self.assertEqual(escode.decode(escode.encode(obj)), obj)
+
+    def test_clear(self):
+        dec = escode.Decoder()
+        first = dec.decode(self.blobs[0])
+        dec.clear()
+        second = dec.decode(self.blobs[0])
+        self.assertEqual(first, second)
+        k1 = [k for k in first if k == u'name'][0]
+        k2 = [k for k in second if k == u'name'][0]
+        self.assertIsNot(k1, k2)
+
+    def test_errors(self):
+        dec = escode.Decoder()
+        with self.assertRaises(escode.DecodeError):
+            dec.decode(u'text')
+        with self.assertRaises(escode.DecodeError):
+            dec.decode(self.blobs[0][:-1])
+        # a key that is invalid UTF-8 is not cached
+        bad = escode.encode({u'ab': 1}).replace(b'ab', b'\xff\xfe')
+        with self.assertRaises(UnicodeDecodeError):
+            dec.decode(bad)
+        self.assertEqual(dec.decode(self.blobs[3]), self.recs[3])
@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import escode
+
+
+class TestDedup(TestCase):
+    def setUp(self):
+        self.encoder = escode.Encoder(dedup=True)
+        self.records = [{u'id': i, u'status': [u'active', u'suspended'][i % 2],
+                         u'country': u'New Zealand', u'note': u'n%d' % i,
+                         u'raw': b'payload bytes'}
+                        for i in range(100)]
+
+    def roundtrip(self, value, encoder=None):
+        blob = (encoder or self.encoder).encode(value)
+        self.assertEqual(escode.decode(blob), value)
+        self.assertEqual(escode.validate(blob), len(blob))
+        self.assertEqual(escode.Decoder(release_gil=True).decode(blob), value)
+        self.assertEqual(escode.Decoder(cache_keys=False).decode(blob), value)
+        return blob
+
+    def test_roundtrip(self):
+        for value in (u'', u'text', [u'ab', u'ab', u'ab'], [u'\xe9t\xe9'] * 3,
+                      {u'k': u'k'}, (1, None, u'x' * 300, u'x' * 300), self.records):
+            self.roundtrip(value)
+            self.roundtrip(value, escode.Encoder(dedup=True, compact=True))
+        self.assertTrue(self.encoder.dedup)
+        self.assertFalse(escode.Encoder().dedup)
+
+    def test_smaller(self):
+        blob = self.roundtrip(self.records)
+        self.assertLess(len(blob), len(escode.encode(self.records)) * 0.6)
+        # one byte str are never worth a reference
+        self.assertEqual(self.encoder.encode([u'a'] * 3), b'\xe0' + escode.encode([u'a'] * 3))
+
+    def test_shared_objects(self):
+        blob = self.encoder.encode(self.records)
+        for decoder in (escode, escode.Decoder(cache_keys=False),
+                        escode.Decoder(release_gil=True)):
+            out = decoder.decode(blob)
+            self.assertIs(out[0][u'country'], out[1][u'country'])
+            self.assertIs(out[0][u'status'], out[2][u'status'])
+            keys = [list(record)[1] for record in out]
+            self.assertTrue(all(key is keys[0] for key in keys))
+            self.assertIsNot(out[0][u'raw'], out[1][u'raw'])
+
+    def test_paths_and_lazy(self):
+        data = {u'records': self.records}
+        blob = self.encoder.encode(data)
+        self.assertEqual(escode.get(blob, u'records[7].status'), u'suspended')
+        self.assertEqual(escode.get(blob, u'records[8].country'), u'New Zealand')
+        self.assertIsNone(escode.get(blob, u'records[8].missing', None))
+        self.assertEqual(escode.project(blob, [u'records[3].note']),
+                         {u'records[3].note': u'n3'})
+        lazy = escode.loads_lazy(blob)
+        self.assertEqual(lazy[u'records'][9][u'status'], u'suspended')
+        self.assertEqual(dict(lazy[u'records'][4]), self.records[4])
+
+    def test_streams(self):
+        blob = b''.join(self.encoder.encode(record) for record in self.records[:10])
+        self.assertEqual(list(escode.iter_decode(blob)), self.records[:10])
+        decoder = escode.StreamDecoder()
+        out = []
+        for pos in range(0, len(blob), 5):
+            out.extend(decoder.feed(blob[pos:pos + 5]))
+        self.assertEqual(out, self.records[:10])
+
+    def test_not_with_tables(self):
+        with self.assertRaises(ValueError):
+            escode.Encoder(dedup=True, table_min=8)
+
+    def test_corrupt(self):
+        blob = self.encoder.encode([u'abc', u'abc'])
+        self.assertEqual(blob[-2:], b'\xe8\x05')
+        for bad in (blob[:-1] + b'\x09', blob[:-1] + b'\x02', blob[:-1] + b'\x00',
+                    b'\xe8\x01'):
+            with self.assertRaises(escode.DecodeError):
+                escode.decode(bad)
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(bad)
@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import threading
+import escode
+
+
+class TestEncoder(TestCase):
+    def setUp(self):
+        self.objs = [{u'id': i, u'payload': u'x' * (i * 37 % 2000),
+                      u'vals': list(range(i % 50))} for i in range(200)]
+
+    def test_matches_encode(self):
+        enc = escode.Encoder()
+        for obj in self.objs:
+            self.assertEqual(enc.encode(obj), escode.encode(obj))
+
+    def test_size_hint_follows_outputs(self):
+        enc = escode.Encoder()
+        self.assertEqual(enc.size_hint, 256)
+
+        big = escode.encode([b'\x01' * 10000])
+        enc.encode([b'\x01' * 10000])
+        self.assertGreaterEqual(enc.size_hint, len(big))
+
+        # one small output keeps most of the hint, many wear it down
+        enc.encode(None)
+        self.assertGreater(enc.size_hint, len(big) // 2)
+        for _ in range(100):
+            enc.encode(None)
+        self.assertLess(enc.size_hint, 64)
+
+    def test_size_hint_ignores_huge_outputs(self):
+        enc = escode.Encoder()
+        enc.encode([1, 2, u'a'])
+        hint = enc.size_hint
+        enc.encode(b'x' * (2 << 20))
+        self.assertEqual(enc.size_hint, hint)
+
+    def test_initial_size_hint(self):
+        enc = escode.Encoder(size_hint=1 << 16)
+        self.assertEqual(enc.size_hint, 1 << 16)
+        self.assertEqual(escode.Encoder(size_hint=1 << 33).size_hint, 1 << 33)
+        self.assertEqual(enc.encode(self.objs[3]), escode.encode(self.objs[3]))
+        self.assertEqual(escode.Encoder(0).encode(u'abc'), escode.encode(u'abc'))
+        with self.assertRaises(TypeError):
+            escode.Encoder(size_hint=u'big')
+
+    def test_errors(self):
+        enc = escode.Encoder()
+        with self.assertRaises(escode.UnsupportedTypeError):
+            enc.encode(object())
+        self.assertEqual(enc.encode(self.objs[5]), escode.encode(self.objs[5]))
+
+    def test_module_encode_across_threads(self):
+        expected = [escode.encode(obj) for obj in self.objs]
+        failures = []
+
+        def run(objs):
+            for _ in range(20):
+                if [escode.encode(obj) for obj in objs] != expected:
+                    failures.append(1)
+
+        threads = [threading.Thread(target=run, args=(self.objs,))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(failures, [])
@@ -13,14 +13,14 @@ class TestEncodeErrors(TestCase):
         def fn():
             return None
 
-        for bad in (datetime.utcnow(), object(), bytearray(b'ab'), 1 + 2j, fn):
+        for bad in (datetime.utcnow(), object(), 1 + 2j, fn):
             with self.assertRaises(escode.UnsupportedTypeError):
                 escode.encode(bad)
 
 
 class TestDecodeInput(TestCase):
-    def test_decode_rejects_non_bytes(self):
-        for bad in (u'notbytes', 123, None, [1, 2], bytearray(b'x')):
+    def test_decode_rejects_non_buffers(self):
+        for bad in (u'notbytes', 123, None, [1, 2]):
             with self.assertRaises(escode.DecodeError):
                 escode.decode(bad)
 
@@ -57,7 +57,7 @@ class TestRobustness(TestCase):
         for n in range(len(good)):
             try:
                 escode.decode(good[:n])
-            except Exception:
+            except escode.DecodeError:
                 pass
 
     def test_corrupt_length_header_rejected(self):
@@ -85,6 +85,39 @@ class TestRobustness(TestCase):
         with self.assertRaises(RecursionError):
             escode.encode(cyclic)
 
+    def test_max_depth_is_independent_of_recursion_limit(self):
+        depth = sys.getrecursionlimit() * 4
+        nested = []
+        cur = nested
+        for _ in range(depth):
+            child = [1]
+            cur.append(child)
+            cur = child
+
+        default = escode.get_max_depth()
+        escode.set_max_depth(depth + 1)
+        try:
+            blob = escode.encode(nested)
+            self.assertEqual(escode.encoded_size(nested), len(blob))
+        finally:
+            escode.set_max_depth(default)
+        self.assertEqual(escode.get_max_depth(), default)
+
+        with self.assertRaises(RecursionError):
+            escode.encode(nested)
+
+        escode.set_max_depth(depth + 1)
+        try:
+            # (== on the result would hit the interpreter's own limit)
+            self.assertEqual(escode.encode(escode.decode(blob)), blob)
+        finally:
+            escode.set_max_depth(default)
+        with self.assertRaises(RecursionError):
+            escode.decode(blob)
+
+        with self.assertRaises(ValueError):
+            escode.set_max_depth(0)
+
     def test_deeply_nested_decode_raises(self):
         # Craft a blob of deeply nested single-element lists. Without a guard
         # this overflows the C stack; it must raise RecursionError instead.
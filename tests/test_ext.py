@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import fractions
+import escode
+
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x, self.y = x, y
+
+    def __eq__(self, other):
+        return (type(other) is Point and
+                (self.x, self.y) == (other.x, other.y))
+
+
+class TestExtensionTypes(TestCase):
+    def setUp(self):
+        escode.register(Point, 1, lambda p: (p.x, p.y), lambda v: Point(*v))
+
+    def tearDown(self):
+        for cls in (Point, fractions.Fraction):
+            try:
+                escode.unregister(cls)
+            except KeyError:
+                pass
+
+    def test_roundtrip(self):
+        obj = {u'a': Point(1, 2), u'b': [Point(3, u'x'), None, Point(-1, 2.5)]}
+        self.assertEqual(escode.decode(escode.encode(obj)), obj)
+        self.assertEqual(escode.encoded_size(obj), len(escode.encode(obj)))
+
+    def test_nested_extension_values(self):
+        # An extension value may contain other extension objects
+        obj = Point(Point(1, 2), [Point(3, 4)])
+        self.assertEqual(escode.decode(escode.encode(obj)), obj)
+
+    def test_several_types(self):
+        escode.register(fractions.Fraction, 200,
+                        lambda f: (f.numerator, f.denominator),
+                        lambda v: fractions.Fraction(*v))
+        obj = [fractions.Fraction(1, 3), Point(0, 0)]
+        self.assertEqual(escode.decode(escode.encode(obj)), obj)
+
+    def test_unregistered(self):
+        blob = escode.encode(Point(1, 2))
+        escode.unregister(Point)
+        with self.assertRaises(escode.UnsupportedTypeError):
+            escode.encode(Point(1, 2))
+        with self.assertRaises(escode.DecodeError):
+            escode.decode(blob)
+        with self.assertRaises(KeyError):
+            escode.unregister(Point)
+
+    def test_code_out_of_range(self):
+        # extension codes are 0..255; wider head numbers are corrupt input
+        for blob in (b'\x93\x40\x40\x40\x40\x28\x07', b'\x91\x01\x00\x00'):
+            with self.assertRaises(escode.DecodeError):
+                escode.decode(blob)
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(blob)
+            with self.assertRaises(escode.DecodeError):
+                escode.Decoder(release_gil=True).decode(blob)
+
+    def test_reregister_moves_code(self):
+        escode.register(Point, 7, lambda p: [p.x, p.y], lambda v: Point(*v))
+        self.assertEqual(escode.decode(escode.encode(Point(5, 6))), Point(5, 6))
+        # code 1 is free again
+        escode.register(fractions.Fraction, 1, lambda f: str(f), fractions.Fraction)
+        self.assertEqual(escode.decode(escode.encode(fractions.Fraction(1, 2))),
+                         fractions.Fraction(1, 2))
+
+    def test_bad_registrations(self):
+        with self.assertRaises(ValueError):
+            escode.register(fractions.Fraction, 1, str, str)  # code taken
+        with self.assertRaises(ValueError):
+            escode.register(dict, 2, str, str)  # native type
+        with self.assertRaises(ValueError):
+            escode.register(bool, 2, str, str)
+        with self.assertRaises(ValueError):
+            escode.register(fractions.Fraction, 256, str, str)
+        with self.assertRaises(TypeError):
+            escode.register(fractions.Fraction, 2, None, str)
+        with self.assertRaises(TypeError):
+            escode.register(Point(1, 2), 2, str, str)
+
+    def test_subclass_not_matched(self):
+        class SubPoint(Point):
+            pass
+        with self.assertRaises(escode.UnsupportedTypeError):
+            escode.encode(SubPoint(1, 2))
+
+    def test_hook_errors_propagate(self):
+        def fail(obj):
+            raise ZeroDivisionError
+        escode.register(Point, 1, fail, fail)
+        with self.assertRaises(ZeroDivisionError):
+            escode.encode([1, Point(1, 2)])
+        escode.register(Point, 1, lambda p: 0, fail)
+        with self.assertRaises(ZeroDivisionError):
+            escode.decode(escode.encode({u'k': [Point(1, 2)]}))
+
+    def test_self_returning_hook_is_bounded(self):
+        escode.register(Point, 1, lambda p: p, lambda v: v)
+        with self.assertRaises(RecursionError):
+            escode.encode(Point(1, 2))
+
+    def test_not_index_encodable(self):
+        with self.assertRaises(escode.EncodeError):
+            escode.encode_index((Point(1, 2),))
+
+    def test_mutation_during_encode(self):
+        data = [Point(1, 2), 1, 2]
+        def shrink(p):
+            del data[1:]
+            return 0
+        escode.register(Point, 1, shrink, lambda v: v)
+        with self.assertRaises(RuntimeError):
+            escode.encode(data)
+
+    def test_capi_capsule(self):
+        self.assertIn('capsule', repr(escode._C_API))
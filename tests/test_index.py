@@ -55,6 +55,13 @@ class TestIndex00s(TestCase):
         # trailing 0s should result in the same encoding
         self.assertEqual(len(encodings), 1)
 
+    def test_lone00s_grow_the_output(self):
+        # Each lone \x00 escapes to two bytes, so the escaped string is
+        # longer than its input and must not overrun the buffer
+        s = b'\x01\x00' * 5000
+        enc = escode.encode_index((s,))
+        self.assertEqual(enc, b'\x01\x00\xff' * 4999 + b'\x01\x00\x00')
+
     def test_number_trailing00s(self):
         encodings = set(escode.encode_index((n,)) for n in self.numbers)
         # trailing 0s in numbers should not result in the same encoding
@@ -24,6 +24,10 @@ class TestInt(TestCase):
             (1<<32)-1, (1<<32), (1<<32)+1,
             (1<<63)-1, (1<<63), (1<<63)+1,
             (1<<64)-1,
+            # around the compact (single digit) and 3 byte boundaries
+            -(1<<30)-1, -(1<<30), -(1<<30)+1, (1<<30)-1, (1<<30), (1<<30)+1,
+            -(1<<23)-1, -(1<<23), (1<<23)-1, (1<<24)-1, (1<<24),
+            -5, 256, 257,
         ] + [random.randint(-0x0fffffffffffffff, 0x0fffffffffffffff) for x in range(20)]
 
     def test_int(self):
@@ -41,3 +45,47 @@ class TestInt(TestCase):
         numsorted = sorted(zipped, key=lambda num_enc: num_enc[0])
         encsorted = sorted(zipped, key=lambda num_enc: num_enc[1])
         self.assertEqual(numsorted, encsorted)
+
+    def test_small_int_identity(self):
+        # Cached small ints decode to the cached objects themselves.
+        for num in (-5, 0, 1, 100, 256):
+            self.assertIs(escode.decode(escode.encode(num)), num)
+        self.assertIs(type(escode.decode(escode.encode(1 << 29))), int)
+
+
+class TestBigInt(TestCase):
+    """Ints outside int64/uint64 use ESTYPE_BIGINT, and under encode_index
+    extend the widest INT encodings so ordering holds across both."""
+
+    def setUp(self):
+        self.nums = [
+            (1<<64)-1, 1<<64, (1<<64)+1, (1<<71)-1, 1<<71, 1<<72,
+            (1<<127)+12345, 1<<128, 1<<2048, 1<<(8*300), (1<<(8*300))+1,
+            -(1<<63), -(1<<63)-1, -(1<<64), -(1<<64)-1, -(1<<71), -(1<<72),
+            -(1<<127)-12345, -(1<<128), -(1<<2048), -(1<<(8*300)),
+            -(1<<(8*300))-1,
+        ] + [random.randint(-(1<<200), 1<<200) for x in range(30)]
+        self.nums += [x * 3 for x in self.nums]
+
+    def test_roundtrip(self):
+        for num in self.nums:
+            enc = escode.encode(num)
+            self.assertEqual(num, escode.decode(enc))
+            self.assertEqual(len(enc), escode.encoded_size(num))
+        self.assertEqual(escode.decode(escode.encode(self.nums)), self.nums)
+
+    def test_index_order(self):
+        nums = self.nums + [0, 1, -1, (1<<63), -(1<<62), (1<<64)-2]
+        zipped = [(x, escode.encode_index((x,))) for x in nums]
+        numsorted = sorted(zipped, key=lambda num_enc: num_enc[0])
+        encsorted = sorted(zipped, key=lambda num_enc: num_enc[1])
+        self.assertEqual(numsorted, encsorted)
+
+    def test_index_order_in_tuples(self):
+        # A following element must not affect the order of the int before it
+        nums = [(1<<64)-1, 1<<64, -(1<<63), -(1<<63)-1]
+        tails = [(), (None,), (True,), (1<<64,), (u'z',), ([1],)]
+        tuples = [(n,) + t for n in nums for t in tails]
+        encsorted = sorted(tuples, key=escode.encode_index)
+        self.assertEqual([t[0] for t in encsorted], sorted(t[0] for t in tuples))
+
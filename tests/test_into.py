@@ -0,0 +1,62 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import mmap
+import escode
+
+
+class TestEncodeInto(TestCase):
+    def setUp(self):
+        self.obj = {u'id': 12, u'name': u'record', u'blob': b'\x00' * 600,
+                    u'vals': [1.5, None, (True, -3)]}
+        self.enc = escode.encode(self.obj)
+
+    def test_bytearray(self):
+        buf = bytearray(len(self.enc) + 10)
+        written = escode.encode_into(self.obj, buf)
+        self.assertEqual(written, len(self.enc))
+        self.assertEqual(bytes(buf[:written]), self.enc)
+        self.assertEqual(escode.decode(bytes(buf[:written])), self.obj)
+
+    def test_offset(self):
+        buf = bytearray(b'\xaa' * (len(self.enc) + 20))
+        written = escode.encode_into(self.obj, buf, 7)
+        self.assertEqual(bytes(buf[:7]), b'\xaa' * 7)
+        self.assertEqual(bytes(buf[7:7 + written]), self.enc)
+        self.assertEqual(bytes(buf[7 + written:]), b'\xaa' * 13)
+
+    def test_back_to_back(self):
+        buf = bytearray(4096)
+        offset = 0
+        for rec in ([1, 2], u'two', {u'three': 3}):
+            offset += escode.encode_into(rec, buf, offset)
+        self.assertEqual(bytes(buf[:offset]), b''.join(
+            escode.encode(rec) for rec in ([1, 2], u'two', {u'three': 3})))
+
+    def test_mmap_and_memoryview(self):
+        mm = mmap.mmap(-1, 4096)
+        written = escode.encode_into(self.obj, mm, 100)
+        self.assertEqual(mm[100:100 + written], self.enc)
+        buf = bytearray(4096)
+        written = escode.encode_into(self.obj, memoryview(buf)[50:])
+        self.assertEqual(bytes(buf[50:50 + written]), self.enc)
+
+    def test_too_small_reports_needed(self):
+        for avail in (0, 1, len(self.enc) - 1):
+            buf = bytearray(5 + avail)
+            with self.assertRaises(escode.EncodeError) as ctx:
+                escode.encode_into(self.obj, buf, 5)
+            self.assertEqual(ctx.exception.needed, len(self.enc))
+        buf = bytearray(len(self.enc))
+        self.assertEqual(escode.encode_into(self.obj, buf), len(self.enc))
+
+    def test_bad_arguments(self):
+        with self.assertRaises(TypeError):
+            escode.encode_into(1, b'readonly bytes')
+        with self.assertRaises(ValueError):
+            escode.encode_into(1, bytearray(4), 5)
+        with self.assertRaises(ValueError):
+            escode.encode_into(1, bytearray(4), -1)
+        with self.assertRaises(escode.UnsupportedTypeError):
+            escode.encode_into(object(), bytearray(4))
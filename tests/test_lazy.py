@@ -0,0 +1,138 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+from collections.abc import Mapping, Sequence
+from decimal import Decimal
+
+import escode
+
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x, self.y = x, y
+
+    def __eq__(self, other):
+        return type(other) is Point and (self.x, self.y) == (other.x, other.y)
+
+
+class TestLoadsLazy(TestCase):
+    def setUp(self):
+        self.obj = {u'id': 7, u'name': u'rec', b'raw': b'\x00\x01',
+                    u'nested': {u'a': [1, 2, {u'b': None}], u'c': (1, 2)},
+                    u'list': [1.5, Decimal('-1.25'), 2 ** 80, {1, 2}, [], {}],
+                    3: True}
+        self.blob = escode.encode(self.obj)
+
+    def test_dict_access(self):
+        lazy = escode.loads_lazy(self.blob)
+        self.assertIsInstance(lazy, escode.LazyDict)
+        self.assertIsInstance(lazy, Mapping)
+        self.assertEqual(len(lazy), len(self.obj))
+        self.assertEqual(lazy[u'id'], 7)
+        self.assertEqual(lazy[b'raw'], b'\x00\x01')
+        self.assertIs(lazy[3], True)
+        self.assertIn(u'name', lazy)
+        self.assertNotIn(u'missing', lazy)
+        self.assertEqual(lazy.get(u'missing', 5), 5)
+        self.assertIsNone(lazy.get(u'missing'))
+        with self.assertRaises(KeyError):
+            lazy[u'missing']
+        self.assertEqual(sorted(map(repr, lazy)), sorted(map(repr, self.obj)))
+        self.assertEqual(lazy.keys(), list(self.obj.keys()))
+        self.assertEqual(lazy.values()[0], 7)
+        self.assertEqual(dict(lazy.items())[u'name'], u'rec')
+
+    def test_str_keys_without_index(self):
+        record = {u'f%d' % i: [i] for i in range(200)}
+        record[u'\xe9t\xe9'] = {u'x': 1}
+        for blob in (escode.encode(record), escode.Encoder(compact=True).encode(record),
+                     escode.Encoder(dedup=True).encode([record, record])):
+            lazy = escode.loads_lazy(blob)
+            if isinstance(lazy, escode.LazyList):
+                lazy = lazy[1]
+            value = lazy[u'f150']
+            self.assertEqual(value, [150])
+            self.assertIs(lazy[u'f150'], value)
+            self.assertEqual(lazy[u'\xe9t\xe9'][u'x'], 1)
+            self.assertIn(u'f0', lazy)
+            self.assertNotIn(u'f200', lazy)
+            self.assertNotIn(u'\ud800', lazy)
+            self.assertIsNone(lazy.get(u'f', None))
+            # Indexing for iteration keeps what was already decoded
+            self.assertEqual(len(list(lazy)), 201)
+            self.assertIs(lazy[u'f150'], value)
+            self.assertEqual(lazy, record)
+
+    def test_nested_proxies(self):
+        lazy = escode.loads_lazy(self.blob)
+        nested = lazy[u'nested']
+        self.assertIsInstance(nested, escode.LazyDict)
+        self.assertIs(lazy[u'nested'], nested)
+        items = nested[u'a']
+        self.assertIsInstance(items, escode.LazyList)
+        self.assertIsInstance(items, Sequence)
+        self.assertEqual(items[2][u'b'], None)
+        self.assertEqual(nested[u'c'], (1, 2))
+        self.assertEqual(type(nested[u'c']), tuple)
+        self.assertEqual(lazy[u'list'][3], {1, 2})
+        self.assertEqual(lazy[u'list'][2], 2 ** 80)
+
+    def test_list_access(self):
+        data = list(range(20)) + [[u'x'], {u'y': 1}]
+        lazy = escode.loads_lazy(escode.encode(data))
+        self.assertIsInstance(lazy, escode.LazyList)
+        self.assertEqual(len(lazy), 22)
+        self.assertEqual(lazy[5], 5)
+        self.assertEqual(lazy[-3], 19)
+        self.assertEqual(lazy[2:8:3], [2, 5])
+        self.assertEqual(lazy[-1][u'y'], 1)
+        self.assertEqual(list(lazy)[:3], [0, 1, 2])
+        self.assertIn(7, lazy)
+        with self.assertRaises(IndexError):
+            lazy[22]
+        with self.assertRaises(TypeError):
+            lazy[u'x']
+
+    def test_materialize_and_equality(self):
+        lazy = escode.loads_lazy(self.blob)
+        self.assertEqual(lazy.materialize(), self.obj)
+        self.assertEqual(type(lazy.materialize()), dict)
+        self.assertEqual(lazy, self.obj)
+        self.assertEqual(lazy[u'list'].materialize(), self.obj[u'list'])
+        self.assertEqual(lazy[u'list'], escode.loads_lazy(self.blob)[u'list'])
+        self.assertNotEqual(lazy, {})
+
+    def test_scalars_and_empty(self):
+        self.assertEqual(escode.loads_lazy(escode.encode(u'abc')), u'abc')
+        self.assertEqual(escode.loads_lazy(escode.encode((1, [2]))), (1, [2]))
+        self.assertIsNone(escode.loads_lazy(b''))
+        self.assertEqual(len(escode.loads_lazy(escode.encode({}))), 0)
+
+    def test_buffers(self):
+        lazy = escode.loads_lazy(bytearray(self.blob))
+        self.assertEqual(lazy[u'name'], u'rec')
+        view = memoryview(self.blob)
+        lazy = escode.loads_lazy(view)
+        del view
+        self.assertEqual(lazy, self.obj)
+        with self.assertRaises(escode.DecodeError):
+            escode.loads_lazy(u'abc')
+
+    def test_extension_values(self):
+        escode.register(Point, 3, lambda p: [p.x, p.y], lambda v: Point(*v))
+        try:
+            lazy = escode.loads_lazy(escode.encode({u'p': Point(1, 2), u'q': 1}))
+            self.assertEqual(lazy[u'q'], 1)
+            self.assertEqual(lazy[u'p'], Point(1, 2))
+        finally:
+            escode.unregister(Point)
+
+    def test_truncated(self):
+        for end in range(1, len(self.blob)):
+            try:
+                lazy = escode.loads_lazy(self.blob[:end])
+                if isinstance(lazy, escode.LazyDict):
+                    lazy.values()
+            except escode.DecodeError:
+                continue
+            self.fail('no error at %d' % end)
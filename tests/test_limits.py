@@ -1,14 +1,34 @@
 #!/usr/bin/env python
 
 from unittest import TestCase
+import mmap
 import escode
 
 
 class TestLimits(TestCase):
     def setUp(self):
-        self.bad_requests = [1<<64, -(1<<63)-1]
+        # Just past the int64/uint64 range, which used to be rejected
+        self.edges = [1<<64, -(1<<63)-1]
 
-    def test_bad(self):
-        for bad in self.bad_requests:
-            with self.assertRaises(Exception):
-                enc = escode.encode(bad)
+    def test_edges(self):
+        for num in self.edges:
+            self.assertEqual(escode.decode(escode.encode(num)), num)
+            self.assertEqual(escode.encoded_size(num), len(escode.encode(num)))
+
+    def test_offsets_past_4gb(self):
+        # Sparse: only the pages written to are ever backed
+        size = (5 << 30) + 4096
+        try:
+            mm = mmap.mmap(-1, size)
+        except (OSError, OverflowError, MemoryError, ValueError):
+            self.skipTest('can not map %d bytes' % size)
+
+        obj = {u'id': 1, u'vals': [1.5, b'x' * 100]}
+        enc = escode.encode(obj)
+        offset = size - 4096
+        self.assertEqual(escode.encode_into(obj, mm, offset), len(enc))
+        self.assertEqual(mm[offset:offset + len(enc)], enc)
+        self.assertEqual(escode.decode(memoryview(mm)[offset:]), obj)
+        with self.assertRaises(escode.EncodeError):
+            escode.encode_into(b'y' * 5000, mm, offset)
+        mm.close()
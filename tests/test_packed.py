@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+import array
+import math
+
+import escode
+
+
+class TestPackedArrays(TestCase):
+    def setUp(self):
+        self.encoder = escode.Encoder(pack_min=4)
+
+    def roundtrip(self, value):
+        blob = self.encoder.encode(value)
+        self.assertEqual(escode.decode(blob), value)
+        self.assertEqual(escode.validate(blob), len(blob))
+        self.assertEqual(escode.Decoder(release_gil=True).decode(blob), value)
+        return blob
+
+    def test_lists(self):
+        values = [[0.5, -1.25, 1e300, float('inf')] * 3,
+                  [True, False] * 9 + [True],
+                  [1, -2, 3, 127, -128],
+                  [1, 2, 3, 40000],
+                  [1, 2, 3, -2 ** 31],
+                  [1, 2, 3, 2 ** 62] * 10,
+                  {u'vec': [0.25] * 100, u'ids': list(range(100))}]
+        for value in values:
+            blob = self.roundtrip(value)
+            self.assertLessEqual(len(blob), len(escode.encode(value)))
+        self.assertEqual(len(self.encoder.encode([0.5] * 100)), 3 + 800)
+        self.assertEqual(len(self.encoder.encode([True] * 100)), 3 + 13)
+        nan = escode.decode(self.encoder.encode([float('nan')] * 4))
+        self.assertTrue(all(math.isnan(x) for x in nan))
+
+    def test_not_packed(self):
+        for value in ([1, 2, 3], [1, 2, 3, 2 ** 64], [1, 2, 3, 4.0], [True, 1, 2, 3],
+                      (1.0, 2.0, 3.0, 4.0), [1, 2, 3, 2 ** 40]):
+            self.assertEqual(self.roundtrip(value), escode.encode(value))
+        self.assertEqual(escode.encode([1.0] * 10), escode.Encoder().encode([1.0] * 10))
+
+    def test_array_array(self):
+        for code in 'bhilqfdBHILQ':
+            value = array.array(code, [1, 2, 3, 4 if code.isupper() else -4] * 5)
+            blob = escode.encode(value)
+            self.assertEqual(escode.encoded_size(value), len(blob))
+            self.assertEqual(escode.decode(blob), value.tolist())
+            decoded = escode.Decoder(arrays=True).decode(blob)
+            self.assertIsInstance(decoded, array.array)
+            self.assertEqual(decoded.tolist(), value.tolist())
+            self.assertEqual(decoded.itemsize, value.itemsize)
+        self.assertEqual(escode.decode(escode.encode(array.array('d'))), [])
+        with self.assertRaises(escode.UnsupportedTypeError):
+            escode.encode(array.array('u', u'text'))
+        with self.assertRaises(escode.EncodeError):
+            escode.encode_index((array.array('d', [1.0]),))
+
+    def test_arrays_option(self):
+        blob = self.encoder.encode({u'v': [1.5] * 8, u'b': [True] * 8, u'n': [7] * 8})
+        decoded = escode.Decoder(arrays=True).decode(blob)
+        self.assertEqual(decoded[u'v'], array.array('d', [1.5] * 8))
+        self.assertEqual(decoded[u'n'], array.array('b', [7] * 8))
+        self.assertEqual(decoded[u'b'], [True] * 8)
+
+    def test_paths(self):
+        data = {u'root': [1.5, 2.5], u'flags': [True, False, True], u'ids': [7, -8, 300],
+                u'arr': array.array('Q', [1, 2 ** 64 - 1])}
+        blob = escode.Encoder(pack_min=1).encode(data)
+        self.assertEqual(escode.get(blob, [u'root', 0]), 1.5)
+        self.assertEqual(escode.get(blob, u'root[-1]'), 2.5)
+        self.assertIs(escode.get(blob, u'flags[1]'), False)
+        self.assertEqual(escode.get(blob, u'ids[2]'), 300)
+        self.assertEqual(escode.get(blob, u'arr[1]'), 2 ** 64 - 1)
+        self.assertEqual(escode.get(blob, u'root'), [1.5, 2.5])
+        for missing in (u'root[2]', u'root[-3]', u'root[0].x', (u'root', u'x')):
+            self.assertIsNone(escode.get(blob, missing))
+        path = escode.Path(u'root[1]')
+        self.assertEqual(escode.project(blob, [u'ids[1]', path]),
+                         {u'ids[1]': -8, path: 2.5})
+
+    def test_corrupt(self):
+        blob = self.encoder.encode([0.5] * 10)
+        for end in range(1, len(blob)):
+            with self.assertRaises(escode.DecodeError):
+                escode.decode(blob[:end])
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(blob[:end])
+        bad = blob[:2] + b'x' + blob[3:]
+        with self.assertRaises(escode.DecodeError):
+            escode.decode(bad)
+        with self.assertRaises(escode.DecodeError):
+            escode.validate(bad)
+        huge = blob[:1] + b'\xff' + blob[2:]
+        with self.assertRaises(escode.DecodeError):
+            escode.decode(huge)
@@ -0,0 +1,66 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import escode
+
+
+class TestPath(TestCase):
+    def setUp(self):
+        self.obj = {u'a': {u'b': [10, 11, 12, {u'c': u'deep'}], 3: u'three'},
+                    u'name': u'rec', b'raw': (1, [2, 3]), 7: None,
+                    u'big': [list(range(100))] * 20}
+        self.blob = escode.encode(self.obj)
+
+    def test_parse(self):
+        self.assertEqual(escode.Path(u'a.b[3]').steps, (u'a', u'b', 3))
+        self.assertEqual(escode.Path(u'[0][-1].x').steps, (0, -1, u'x'))
+        self.assertEqual(escode.Path(u'caf\xe9').steps, (u'caf\xe9',))
+        self.assertEqual(escode.Path(u'').steps, ())
+        self.assertEqual(escode.Path([b'raw', 1]).steps, (b'raw', 1))
+        for bad in (u'a.', u'.a', u'a..b', u'a[', u'a[x]', u'a[-]', u'a[1]b', u'[]'):
+            with self.assertRaises(ValueError):
+                escode.Path(bad)
+        with self.assertRaises(TypeError):
+            escode.Path(3)
+        self.assertIn(u"'a'", repr(escode.Path(u'a')))
+
+    def test_get(self):
+        get = escode.get
+        self.assertEqual(get(self.blob, u'name'), u'rec')
+        self.assertEqual(get(self.blob, u'a.b[3].c'), u'deep')
+        self.assertEqual(get(self.blob, u'a.b[-4]'), 10)
+        self.assertEqual(get(self.blob, u'a[3]'), u'three')
+        self.assertEqual(get(self.blob, u'a.b'), [10, 11, 12, {u'c': u'deep'}])
+        self.assertEqual(get(self.blob, (b'raw', 1, 0)), 2)
+        self.assertEqual(get(self.blob, [7]), None)
+        self.assertEqual(get(self.blob, u''), self.obj)
+        self.assertEqual(get(bytearray(self.blob), escode.Path(u'big[19][99]')), 99)
+
+    def test_without_init(self):
+        path = escode.Path.__new__(escode.Path)
+        self.assertEqual(path.steps, ())
+        self.assertEqual(escode.get(self.blob, path), self.obj)
+
+    def test_missing(self):
+        for path in (u'nope', u'a.b[4]', u'a.b[-5]', u'name.x', u'a.b[0][0]',
+                     u'a.b.c', u'[0]', (u'a', u'b', 2 ** 70)):
+            self.assertIsNone(escode.get(self.blob, path))
+            self.assertEqual(escode.get(self.blob, path, 5), 5)
+        # keys match by encoding
+        self.assertIsNone(escode.get(self.blob, (7.0,)))
+
+    def test_project(self):
+        path = escode.Path(u'a.b[1]')
+        self.assertEqual(escode.project(self.blob, [u'name', path, u'missing', (7,)]),
+                         {u'name': u'rec', path: 11, (7,): None})
+        self.assertEqual(escode.project(self.blob, []), {})
+        with self.assertRaises(ValueError):
+            escode.project(self.blob, [u'a.'])
+
+    def test_errors(self):
+        with self.assertRaises(escode.DecodeError):
+            escode.get(u'text', u'a')
+        for end in range(len(self.blob) - 1):
+            with self.assertRaises(escode.DecodeError):
+                escode.get(self.blob[:end], u'big[19][99]')
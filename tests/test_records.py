@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+import io
+import mmap
+import tempfile
+
+import escode
+
+
+class TestIterDecode(TestCase):
+    def setUp(self):
+        self.records = [{u'id': i, u'name': u'rec%d' % i, u'tags': [u'a'] * (i % 4)}
+                        for i in range(300)]
+        self.records += [None, 0, u'', [], b'x' * 200000]
+        self.blobs = [escode.encode(rec) for rec in self.records]
+        self.log = b''.join(self.blobs)
+        self.offsets = []
+        at = 0
+        for blob in self.blobs:
+            self.offsets.append(at)
+            at += len(blob)
+
+    def test_buffers(self):
+        for source in (self.log, bytearray(self.log), memoryview(self.log)):
+            self.assertEqual(list(escode.iter_decode(source)), self.records)
+        self.assertEqual(list(escode.iter_decode(b'')), [])
+
+    def test_offsets(self):
+        pairs = list(escode.iter_decode(self.log, offsets=True))
+        self.assertEqual(pairs, list(zip(self.offsets, self.records)))
+        with open(self._tempfile(), 'rb') as fp:
+            self.assertEqual(list(escode.iter_decode(fp, offsets=True)), pairs)
+
+    def test_mmap(self):
+        with open(self._tempfile(), 'rb') as fp:
+            with mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+                self.assertEqual(list(escode.iter_decode(mm)), self.records)
+
+    def test_files(self):
+        with open(self._tempfile(), 'rb') as fp:
+            self.assertEqual(list(escode.iter_decode(fp)), self.records)
+        self.assertEqual(list(escode.iter_decode(io.BytesIO(self.log))), self.records)
+        self.assertEqual(list(escode.iter_decode(io.BytesIO(b''))), [])
+
+    def test_small_reads(self):
+        # Records split across any read boundary
+        class Trickle(object):
+            def __init__(self, data):
+                self.data, self.pos = data, 0
+            def read(self, n):
+                chunk = self.data[self.pos:self.pos + 7]
+                self.pos += len(chunk)
+                return chunk
+        log = b''.join(self.blobs[:50])
+        self.assertEqual(list(escode.iter_decode(Trickle(log))), self.records[:50])
+
+    def test_truncated(self):
+        log = self.log[:-1]
+        for source in (log, io.BytesIO(log)):
+            it = escode.iter_decode(source)
+            with self.assertRaises(escode.DecodeError):
+                list(it)
+        got = []
+        with self.assertRaises(escode.DecodeError):
+            for rec in escode.iter_decode(io.BytesIO(self.blobs[0] + b'\xf0')):
+                got.append(rec)
+        self.assertEqual(got, self.records[:1])
+
+    def test_bad_sources(self):
+        with self.assertRaises(TypeError):
+            escode.iter_decode(12)
+        with self.assertRaises(TypeError):
+            list(escode.iter_decode(io.StringIO(u'text')))
+
+    def test_shared_keys(self):
+        first, second = list(escode.iter_decode(self.log))[:2]
+        self.assertIs([k for k in first if k == u'name'][0],
+                      [k for k in second if k == u'name'][0])
+
+    def _tempfile(self):
+        fp = tempfile.NamedTemporaryFile(delete=False)
+        self.addCleanup(__import__('os').unlink, fp.name)
+        fp.write(self.log)
+        fp.close()
+        return fp.name
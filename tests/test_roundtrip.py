@@ -61,3 +61,15 @@ class TestRoundtrip(TestCase):
         # for dedup. Repeated encodes of the same value must match.
         for x in (None, 123, u'hello', b'bytes', [1, u'a', 2.0], (1, 2, 3)):
             self.assertEqual(escode.encode(x), escode.encode(x))
+
+    def test_output_across_buffer_growth(self):
+        # Outputs that outgrow the initial stack buffer are grown in place
+        # and shrunk on finish; lengths straddling each resize must be exact.
+        for n in (0, 250, 505, 506, 507, 511, 512, 513, 1024, 5000, 1 << 20):
+            obj = [b'x' * n, u'y' * n]
+            enc = escode.encode(obj)
+            self.assertIs(type(enc), bytes)
+            self.assertEqual(escode.decode(enc), obj)
+            idx = escode.encode_index((b'x' * n, n))
+            self.assertIs(type(idx), bytes)
+            self.assertEqual(idx, escode.encode_index((b'x' * n, n)))
@@ -0,0 +1,35 @@
+# coding: utf8
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+from decimal import Decimal
+import escode
+
+
+class TestEncodedSize(TestCase):
+    def setUp(self):
+        self.objects = [
+            None, True, False, 0, -1, 0x7F, -0x80, 1 << 40, (1 << 64) - 1,
+            -(1 << 63), 0.0, -1.5, float('inf'),
+            b'', b'\x00' * 300, u'', u'ascii', u'\xe9t\xe9', u'ʑʒʓʔ',
+            u'\U0001F600 smile', Decimal('0'), Decimal('-Infinity'),
+            Decimal('123.4500'), Decimal('-1E+300'),
+            [], (), set(), {}, [1, [2, [3, (4, u'5')]]], {1, u'a', b'b'},
+            {u'k': {u'nested': [None, 1.0, {u'x': b'y' * 1000}]}},
+        ]
+
+    def test_matches_encode(self):
+        for obj in self.objects:
+            self.assertEqual(escode.encoded_size(obj), len(escode.encode(obj)), obj)
+
+    def test_matches_encode_large(self):
+        obj = [{u'id': i, u'name': u'näme-%d' % i, u'tags': [u'a', u'b']}
+               for i in range(5000)]
+        self.assertEqual(escode.encoded_size(obj), len(escode.encode(obj)))
+
+    def test_errors_match_encode(self):
+        with self.assertRaises(escode.UnsupportedTypeError):
+            escode.encoded_size(object())
+        with self.assertRaises(escode.EncodeError):
+            escode.encoded_size(u'lone \udc80 surrogate')
@@ -0,0 +1,122 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+import asyncio
+import random
+
+import escode
+
+
+class TestStreamDecoder(TestCase):
+    def setUp(self):
+        self.records = [{u'id': i, u'name': u'rec%d' % i, u'nested': [[i], {u'k': (i, u'v')}]}
+                        for i in range(200)]
+        self.records += [None, 0, u'', [], {}, b'y' * 70000, [[[[]]]]]
+        self.log = b''.join(escode.encode(rec) for rec in self.records)
+
+    def feed_all(self, dec, sizes):
+        out, pos = [], 0
+        while pos < len(self.log):
+            size = next(sizes)
+            out.extend(dec.feed(self.log[pos:pos + size]))
+            pos += size
+        return out
+
+    def test_whole(self):
+        dec = escode.StreamDecoder()
+        self.assertEqual(dec.feed(self.log), self.records)
+        self.assertEqual(dec.buffered, 0)
+        self.assertEqual(dec.feed(b''), [])
+
+    def test_every_split(self):
+        blob = escode.encode(self.records[3]) + escode.encode(self.records[4])
+        for at in range(len(blob) + 1):
+            dec = escode.StreamDecoder()
+            out = dec.feed(blob[:at]) + dec.feed(bytearray(blob[at:]))
+            self.assertEqual(out, self.records[3:5])
+            self.assertEqual(dec.buffered, 0)
+
+    def test_byte_at_a_time(self):
+        dec = escode.StreamDecoder()
+        sizes = iter(lambda: 1, None)
+        self.log = b''.join(escode.encode(rec) for rec in self.records[:20])
+        self.assertEqual(self.feed_all(dec, sizes), self.records[:20])
+
+    def test_random_chunks(self):
+        rng = random.Random(3)
+        for _ in range(5):
+            dec = escode.StreamDecoder()
+            sizes = iter(lambda: rng.randint(1, 5000), None)
+            self.assertEqual(self.feed_all(dec, sizes), self.records)
+
+    def test_buffered(self):
+        dec = escode.StreamDecoder()
+        blob = escode.encode({u'a': [1, 2, 3]})
+        self.assertEqual(dec.feed(blob[:4]), [])
+        self.assertEqual(dec.buffered, 4)
+        dec.reset()
+        self.assertEqual(dec.buffered, 0)
+        self.assertEqual(dec.feed(blob), [{u'a': [1, 2, 3]}])
+
+    def test_without_init(self):
+        dec = escode.StreamDecoder.__new__(escode.StreamDecoder)
+        blob = escode.encode([[[1]], {u'a': [2]}])
+        self.assertEqual(dec.feed(blob[:5]), [])
+        self.assertEqual(dec.feed(blob[5:]), [escode.decode(blob)])
+
+    def test_corrupt_resets(self):
+        dec = escode.StreamDecoder()
+        with self.assertRaises(escode.DecodeError):
+            dec.feed(escode.encode(1) + b'\xf0')
+        self.assertEqual(dec.buffered, 0)
+        self.assertEqual(dec.feed(escode.encode([2])), [[2]])
+        dec.feed(escode.encode([1, 2])[:2])
+        with self.assertRaises(escode.DecodeError):
+            dec.feed(b'\xf0\xf0')
+        with self.assertRaises(escode.DecodeError):
+            dec.feed(u'text')
+
+    def test_depth(self):
+        dec = escode.StreamDecoder()
+        blob = escode.encode([None])[:-1] * (escode.get_max_depth() + 1) + b'\x00'
+        with self.assertRaises(RecursionError):
+            for byte in range(len(blob)):
+                dec.feed(blob[byte:byte + 1])
+
+    def test_asyncio_protocol(self):
+        records = self.records
+        log = self.log
+
+        class Protocol(asyncio.Protocol):
+            def __init__(self):
+                self.decoder = escode.StreamDecoder()
+                self.received = []
+                self.done = asyncio.get_running_loop().create_future()
+
+            def data_received(self, data):
+                self.received.extend(self.decoder.feed(data))
+                if len(self.received) == len(records):
+                    self.done.set_result(self.received)
+
+        async def run():
+            loop = asyncio.get_running_loop()
+            protocols = []
+            def factory():
+                protocols.append(Protocol())
+                return protocols[-1]
+            server = await loop.create_server(factory, '127.0.0.1', 0)
+            port = server.sockets[0].getsockname()[1]
+            reader, writer = await asyncio.open_connection('127.0.0.1', port)
+            for pos in range(0, len(log), 1000):
+                writer.write(log[pos:pos + 1000])
+                await writer.drain()
+            got = await asyncio.wait_for(protocols[0].done, 10)
+            writer.close()
+            server.close()
+            return got
+
+        try:
+            got = asyncio.run(run())
+        except OSError:
+            self.skipTest('no loopback sockets')
+        self.assertEqual(got, records)
@@ -41,3 +41,44 @@ class TestString(TestCase):
         # NUL bytes inside contents must survive a normal (non-index) round-trip.
         for raw in (b'\x00', b'a\x00b', b'\x00' * 300, b'\x00a\x00'):
             self.assertEqual(escode.decode(escode.encode(raw)), raw)
+
+    def test_every_kind(self):
+        # ASCII, latin-1, BMP and astral strings are each written straight
+        # from their own representation; all must match str.encode().
+        for text in (u'plain ascii', u'caf\xe9 \xff', u'Ā߿ࠀ￿',
+                     u'\U0001F600\U0010FFFF', u'mixed a\xe9€\U0001F600',
+                     u'\x00\x7f\x80', u'€' * 1000):
+            enc = escode.encode(text)
+            self.assertTrue(enc.endswith(text.encode('utf8')))
+            self.assertEqual(escode.decode(enc), text)
+
+    def test_lone_surrogate_rejected(self):
+        for text in (u'\ud800', u'a\udfffb', u'\U0001F600\udc00'):
+            with self.assertRaises(escode.EncodeError):
+                escode.encode(text)
+            with self.assertRaises(escode.EncodeError):
+                escode.encode_index((text,))
+
+    def test_decode_kinds_and_lengths(self):
+        # Every kind, at lengths around the 8/16/32 byte ASCII checks, with
+        # the first non-ASCII char at each position
+        for extra in (u'\xe9', u'€', u'\U0001F600'):
+            for size in (0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 70):
+                for at in (0, size // 2, size):
+                    text = u'a' * at + extra + u'b' * (size - at)
+                    self.assertEqual(escode.decode(escode.encode(text)), text)
+                    self.assertEqual(escode.decode(escode.encode({text: 1})), {text: 1})
+            text = u'x' * 40
+            out = escode.decode(escode.encode(text))
+            self.assertEqual(out, text)
+            self.assertTrue(out.isascii())
+
+    def test_decode_invalid_utf8(self):
+        prefix = u'a' * 20
+        for raw in (b'\xff', b'\x80', b'\xc0\xaf', b'\xe0\x80\xaf', b'\xed\xa0\x80',
+                    b'\xf4\x90\x80\x80', b'\xf8\x88\x80\x80\x80', b'\xe2\x82', b'\xc3a'):
+            blob = escode.encode(prefix + u'x' * len(raw))[:-len(raw)] + raw
+            with self.assertRaises(UnicodeDecodeError):
+                escode.decode(blob)
+            with self.assertRaises(UnicodeDecodeError):
+                escode.decode(escode.encode({u'k': 1}).replace(b'k', b'\xff'))
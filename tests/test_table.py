@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+
+import escode
+
+
+class TestTables(TestCase):
+    def setUp(self):
+        self.obj = {u'rows': [{u'id': i, u'name': u'n%d' % i, u'tags': (u'a', i)} for i in range(300)],
+                    u'meta': {u'k%d' % i: i for i in range(500)},
+                    (1, 2, 3): u'tuple key', 7: [b'x' * 70000, b'y' * 70000, 1]}
+        self.encoder = escode.Encoder(table_min=2)
+        self.blob = self.encoder.encode(self.obj)
+
+    def test_roundtrip(self):
+        self.assertEqual(self.encoder.table_min, 2)
+        self.assertGreater(len(self.blob), len(escode.encode(self.obj)))
+        self.assertEqual(escode.decode(self.blob), self.obj)
+        self.assertEqual(escode.Decoder(release_gil=True).decode(self.blob), self.obj)
+        self.assertEqual(escode.validate(self.blob), len(self.blob))
+        self.assertEqual(list(escode.iter_decode(self.blob * 2)), [self.obj] * 2)
+        self.assertEqual(escode.loads_lazy(self.blob), self.obj)
+
+    def test_min(self):
+        self.assertEqual(escode.Encoder().encode(self.obj), escode.encode(self.obj))
+        enc = escode.Encoder(table_min=3)
+        self.assertEqual(enc.encode([1, 2]), escode.encode([1, 2]))
+        self.assertNotEqual(enc.encode([1, 2, 3]), escode.encode([1, 2, 3]))
+        # sets, empty containers and dict keys never get tables
+        self.assertEqual(enc.encode({1, 2, 3}), escode.encode({1, 2, 3}))
+        self.assertEqual(enc.encode([]), escode.encode([]))
+        self.assertIn(escode.encode((1, 2, 3)), enc.encode({(1, 2, 3): None}))
+
+    def test_get(self):
+        plain = escode.encode(self.obj)
+        for path in (u'rows[299].name', u'rows[-300].tags[1]', u'meta.k499', u'meta.k0',
+                     [(1, 2, 3)], [7, 1], [7, 2], u'rows[300]', u'meta.k500', u'meta.k1.x', u''):
+            self.assertEqual(escode.get(self.blob, path, 5), escode.get(plain, path, 5))
+        self.assertEqual(escode.project(self.blob, [u'meta.k7', u'rows[3].id']),
+                         {u'meta.k7': 7, u'rows[3].id': 3})
+
+    def test_lazy(self):
+        lazy = escode.loads_lazy(self.blob)
+        self.assertEqual(lazy[u'rows'][250][u'name'], u'n250')
+        self.assertEqual(lazy[7][1], b'y' * 70000)
+        self.assertEqual(lazy[u'meta'][u'k3'], 3)
+        # str keys are looked up in the dict's table, in either encoding
+        for enc in (self.encoder, escode.Encoder(table_min=2, compact=True)):
+            meta = escode.loads_lazy(enc.encode(self.obj))[u'meta']
+            self.assertEqual(meta[u'k499'], 499)
+            self.assertIn(u'k0', meta)
+            self.assertNotIn(u'k500', meta)
+            self.assertEqual(meta.get(u'k', -1), -1)
+            self.assertEqual(sorted(meta.keys()), sorted(self.obj[u'meta']))
+
+    def test_corrupt(self):
+        blob = escode.Encoder(table_min=1).encode([5])
+        self.assertEqual(blob[:1], b'\xa0')
+        table_len = blob[1]
+        bad = [blob[:1] + bytes([table_len + 1]) + blob[2:3 + table_len] + b'\x00' + blob[2 + table_len:],
+               blob[:2] + b'\x03' + blob[3:],                   # bad offset width
+               blob[:2 + table_len] + escode.encode(5),         # not a container
+               blob[:2 + table_len] + escode.encode([5, 6]),    # count mismatch
+               blob[:2 + table_len] + blob]                     # table after table
+        for data in bad:
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(data)
+            with self.assertRaises(escode.DecodeError):
+                escode.decode(data)
+        for end in range(1, len(self.blob), 997):
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(self.blob[:end])
+
+    def test_bad_offsets(self):
+        # Offsets are only bounds checked: a lookup through a wrong one must
+        # not read outside the input
+        blob = bytearray(escode.Encoder(table_min=1).encode([u'abc', u'de']))
+        blob[4] = 0xff
+        with self.assertRaises(escode.DecodeError):
+            escode.get(bytes(blob), u'[1]')
+        self.assertEqual(escode.decode(bytes(blob)), [u'abc', u'de'])
@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+
+from unittest import TestCase
+from decimal import Decimal
+import threading
+
+import escode
+
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x, self.y = x, y
+
+    def __eq__(self, other):
+        return type(other) is Point and (self.x, self.y) == (other.x, other.y)
+
+
+class TestValidate(TestCase):
+    def setUp(self):
+        self.obj = {u'id': 1, u'caf\xe9': [1.5, None, True, Decimal('3.25'), Decimal('Inf')],
+                    b'raw': (2 ** 90, -2 ** 70, {1, 2}), u'\U0001f600': {u'x': u'y' * 300}}
+        self.blob = escode.encode(self.obj)
+
+    def test_length(self):
+        self.assertEqual(escode.validate(self.blob), len(self.blob))
+        self.assertEqual(escode.validate(self.blob + b'\x00\x00'), len(self.blob))
+        self.assertEqual(escode.validate(bytearray(self.blob)), len(self.blob))
+        self.assertEqual(escode.validate(b''), 0)
+        big = escode.encode([self.obj] * 100)
+        self.assertEqual(escode.validate(memoryview(big)), len(big))
+
+    def test_truncated(self):
+        for end in range(1, len(self.blob)):
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(self.blob[:end])
+
+    def test_bad_utf8(self):
+        for raw in (b'\xff', b'\xc0\x80', b'\xed\xa0\x80', b'\xf4\x90\x80\x80', b'a\xe2\x82'):
+            blob = escode.encode(u'x' * len(raw))[:-len(raw)] + raw
+            with self.assertRaises(escode.DecodeError):
+                escode.validate(blob)
+            with self.assertRaises(ValueError):
+                escode.decode(blob)
+        # bytes are not utf-8 checked
+        self.assertEqual(escode.validate(escode.encode(b'\xff')), 3)
+
+    def test_bad_type(self):
+        with self.assertRaises(escode.DecodeError):
+            escode.validate(b'\xf0')
+
+    def test_depth(self):
+        blob = escode.encode(12)
+        for _ in range(escode.get_max_depth()):
+            blob = escode.encode([None])[:-1] + blob
+        escode.validate(blob)
+        with self.assertRaises(RecursionError):
+            escode.validate(escode.encode([None])[:-1] + blob)
+
+    def test_threads(self):
+        blob = escode.encode([self.obj] * 500)
+        results = []
+        def run():
+            for _ in range(20):
+                results.append(escode.validate(blob))
+        threads = [threading.Thread(target=run) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(results, [len(blob)] * 80)
+
+
+class TestTwoStageDecoder(TestCase):
+    def setUp(self):
+        escode.register(Point, 5, lambda p: (p.x, p.y), lambda v: Point(*v))
+
+    def tearDown(self):
+        escode.unregister(Point)
+
+    def test_matches_decode(self):
+        dec = escode.Decoder(release_gil=True)
+        objs = [None, 1, u'', [], {}, (), [[]], {u'a': {u'b': [1, (2, 3)]}},
+                [Point(1, [Point(2, 3)])], {i: u'v%d' % i for i in range(2000)},
+                [{u'k': b'x' * 100, u'p': Point(i, None)} for i in range(100)]]
+        for obj in objs:
+            self.assertEqual(dec.decode(escode.encode(obj)), obj)
+
+    def test_strings(self):
+        dec = escode.Decoder(release_gil=True)
+        obj = [{u'name': u'n%d' % i, u'caf\xe9': u'\xe9' * (i % 40), u'ascii': u'a' * i,
+                u'\U0001f600': u'x\U0001f600' * (i % 3)} for i in range(200)]
+        for enc in (escode.Encoder(), escode.Encoder(compact=True), escode.Encoder(dedup=True)):
+            result = dec.decode(enc.encode(obj))
+            self.assertEqual(result, obj)
+            self.assertTrue(result[150][u'ascii'].isascii())
+
+    def test_errors(self):
+        dec = escode.Decoder(release_gil=True)
+        blob = escode.encode([{u'k': u'v' * 10}] * 1000)
+        for end in (1, 5, len(blob) // 2, len(blob) - 1):
+            with self.assertRaises(escode.DecodeError):
+                dec.decode(blob[:end])
+        self.assertIsNone(dec.decode(b''))